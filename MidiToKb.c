@@ -32,6 +32,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <limits.h>
 #include <getopt.h>
 #include <errno.h>
 #include <signal.h>
@@ -39,11 +40,53 @@
 #include <sys/types.h>
 #include <sys/poll.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <alsa/asoundlib.h>
 #include <linux/uinput.h>
 
+#ifndef DEBUG
+#define DEBUG 0
+#endif
+
+#if DEBUG
+// Count every heap allocation so the MIDI loop can be checked for none
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static unsigned long gAllocCount;
+
+void *malloc(size_t size)
+{
+    gAllocCount++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    gAllocCount++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    gAllocCount++;
+    return __libc_realloc(ptr, size);
+}
+#define ALLOC_COUNT() gAllocCount
+#else
+#define ALLOC_COUNT() 0UL
+#endif
+
+#define EXEC_DEFAULT_WORKERS 2
+#define EXEC_MAX_WORKERS 16
+#define EXEC_QUEUE_MAX 64
+#define EXEC_MAX_COMMANDS 256
+
+#define BENCH_DEFAULT_THRESHOLD 25.0
+
 #define CC_ASSERT(cond) int __constraint_violated[cond] = {0}
 
 #define NSEC_PER_SEC 1000000000L
@@ -57,6 +100,13 @@ static int send_data_length;
 static float timeout;
 static int stop;
 static int sysex_interval;
+static int verbose;
+static int selftest_iterations;
+static int exec_workers = EXEC_DEFAULT_WORKERS;
+static int do_benchmark;
+static char *benchmark_baseline;
+static char *benchmark_save;
+static float benchmark_threshold = BENCH_DEFAULT_THRESHOLD;
 static snd_rawmidi_t *input, **inputp;
 static snd_rawmidi_t *output, **outputp;
 
@@ -136,16 +186,338 @@ const struct supported_keys_t SUPPORTED_KEYS_ARRAY[] = {
     {"MINUS",       KEY_MINUS       },
     {"EQUAL",       KEY_EQUAL       },
     {"HOME",        KEY_HOME        },
+    {"F13",         KEY_F13         },
+    {"F14",         KEY_F14         },
+    {"F15",         KEY_F15         },
+    {"F16",         KEY_F16         },
+    {"F17",         KEY_F17         },
+    {"F18",         KEY_F18         },
+    {"F19",         KEY_F19         },
+    {"F20",         KEY_F20         },
+    {"F21",         KEY_F21         },
+    {"F22",         KEY_F22         },
+    {"F23",         KEY_F23         },
+    {"F24",         KEY_F24         },
+    {"MOUSE_LEFT",  BTN_LEFT        },
+    {"MOUSE_RIGHT", BTN_RIGHT       },
+    {"MOUSE_MIDDLE",BTN_MIDDLE      },
 };
 #define KEY_COUNT (ARRAY_LENGTH(SUPPORTED_KEYS_ARRAY))
 
+struct typeable_symbols_t {
+    char ascii;
+    int keyCode;
+    int shift;
+};
+
+// Printable symbols for TYPE: actions, assuming a US layout on the host.
+// Letters and digits are resolved through SUPPORTED_KEYS_ARRAY instead.
+const struct typeable_symbols_t TYPEABLE_SYMBOLS_ARRAY[] = {
+//  {ascii, keyCode,            shift   },
+    {' ',   KEY_SPACE,          0       },
+    {'\n',  KEY_ENTER,          0       },
+    {'\t',  KEY_TAB,            0       },
+    {'-',   KEY_MINUS,          0       },
+    {'_',   KEY_MINUS,          1       },
+    {'=',   KEY_EQUAL,          0       },
+    {'+',   KEY_EQUAL,          1       },
+    {'[',   KEY_LEFTBRACE,      0       },
+    {'{',   KEY_LEFTBRACE,      1       },
+    {']',   KEY_RIGHTBRACE,     0       },
+    {'}',   KEY_RIGHTBRACE,     1       },
+    {';',   KEY_SEMICOLON,      0       },
+    {':',   KEY_SEMICOLON,      1       },
+    {'\'',  KEY_APOSTROPHE,     0       },
+    {'"',   KEY_APOSTROPHE,     1       },
+    {'`',   KEY_GRAVE,          0       },
+    {'~',   KEY_GRAVE,          1       },
+    {'\\',  KEY_BACKSLASH,      0       },
+    {'|',   KEY_BACKSLASH,      1       },
+    {',',   KEY_COMMA,          0       },
+    {'<',   KEY_COMMA,          1       },
+    {'.',   KEY_DOT,            0       },
+    {'>',   KEY_DOT,            1       },
+    {'/',   KEY_SLASH,          0       },
+    {'?',   KEY_SLASH,          1       },
+    {'!',   KEY_1,              1       },
+    {'@',   KEY_2,              1       },
+    {'#',   KEY_3,              1       },
+    {'$',   KEY_4,              1       },
+    {'%',   KEY_5,              1       },
+    {'^',   KEY_6,              1       },
+    {'&',   KEY_7,              1       },
+    {'*',   KEY_8,              1       },
+    {'(',   KEY_9,              1       },
+    {')',   KEY_0,              1       },
+};
+#define SYMBOL_COUNT (ARRAY_LENGTH(TYPEABLE_SYMBOLS_ARRAY))
+
+#define TYPE_ACTION_PREFIX "TYPE:"
+#define MAX_COMBO_KEYS 10
+// Worst case per typed character: SHIFT, key down, SYN, key up, SHIFT, SYN
+#define EVENTS_PER_TYPED_CHAR 6
+#define KEYMAP_LINE_MAX 512
+#define MAX_ACTION_EVENTS (KEYMAP_LINE_MAX * EVENTS_PER_TYPED_CHAR)
+
+struct supported_axes_t {
+    const char *ascii;
+    int axis;
+};
+
+const struct supported_axes_t SUPPORTED_REL_AXES_ARRAY[] = {
+//  {ascii,         axis            },
+    {"REL_X",       REL_X           },
+    {"REL_Y",       REL_Y           },
+    {"REL_WHEEL",   REL_WHEEL       },
+    {"REL_HWHEEL",  REL_HWHEEL      },
+};
+#define REL_AXIS_COUNT (ARRAY_LENGTH(SUPPORTED_REL_AXES_ARRAY))
+
+const struct supported_keys_t SUPPORTED_BUTTONS_ARRAY[] = {
+//  {ascii,         keyCode         },
+    {"BTN_A",       BTN_A           },
+    {"BTN_B",       BTN_B           },
+    {"BTN_X",       BTN_X           },
+    {"BTN_Y",       BTN_Y           },
+    {"BTN_TL",      BTN_TL          },
+    {"BTN_TR",      BTN_TR          },
+    {"BTN_TL2",     BTN_TL2         },
+    {"BTN_TR2",     BTN_TR2         },
+    {"BTN_SELECT",  BTN_SELECT      },
+    {"BTN_START",   BTN_START       },
+    {"BTN_MODE",    BTN_MODE        },
+    {"BTN_THUMBL",  BTN_THUMBL      },
+    {"BTN_THUMBR",  BTN_THUMBR      },
+};
+#define BUTTON_COUNT (ARRAY_LENGTH(SUPPORTED_BUTTONS_ARRAY))
+
+const struct supported_axes_t SUPPORTED_ABS_AXES_ARRAY[] = {
+//  {ascii,         axis            },
+    {"ABS_X",       ABS_X           },
+    {"ABS_Y",       ABS_Y           },
+    {"ABS_Z",       ABS_Z           },
+    {"ABS_RX",      ABS_RX          },
+    {"ABS_RY",      ABS_RY          },
+    {"ABS_RZ",      ABS_RZ          },
+};
+#define ABS_AXIS_COUNT (ARRAY_LENGTH(SUPPORTED_ABS_AXES_ARRAY))
+
+// Gamepad axes use the signed 14-bit range of pitch bend; CCs are scaled up
+#define GAMEPAD_AXIS_MIN (-8192)
+#define GAMEPAD_AXIS_MAX 8191
+
+#define MIDI_CHANNELS 16
+#define OMNI_CHANNEL (-1)
+#define CHANNEL_SEPARATOR '@'
+
+#define CC_SOURCE_PREFIX "CC:"
+#define PITCH_BEND_SOURCE "PB"
+#define BUTTON_ACTION_PREFIX "BTN_"
+#define ABS_ACTION_PREFIX "ABS_"
+
+typedef enum
+{
+    CC_MODE_ABS,    // Knob or fader reporting 0-127, delta taken from last value
+    CC_MODE_REL,    // Encoder reporting two's complement: 1-63 up, 65-127 down
+    CC_MODE_OFS,    // Encoder reporting binary offset: 64 is no movement
+} CC_MODE_T;
+
+const char *CC_MODE_NAMES[] = { "ABS", "REL", "OFS" };
+
+typedef struct CcMapT
+{
+    struct CcMapT *pNext;
+    unsigned char cc;
+    // 0-15, or OMNI_CHANNEL when loaded without @channel
+    int channel;
+    int axis;
+    CC_MODE_T mode;
+    // Acceleration curve: out = scale * |delta|^exponent, applied per batch
+    float scale;
+    float exponent;
+    int lastValue;
+    int pendingDelta;
+    // Set when the CC drives a gamepad axis instead of a relative axis
+    struct GamepadAxisT *padAxis;
+} CC_MAP_T;
+CC_MAP_T *gCcMapRoot = NULL;
+CC_MAP_T *gCcMap[MIDI_CHANNELS][128] = {0};
+
+static int gRelDirty;
+static float gRelRemainder[REL_CNT];
+
+typedef struct GamepadAxisT
+{
+    int axis;
+    int deadzone;
+    int quantization;
+    int latest;
+    int emitted;
+    int dirty;
+} GAMEPAD_AXIS_T;
+static GAMEPAD_AXIS_T gGamepadAxes[ABS_CNT];
+GAMEPAD_AXIS_T *gPitchBendMap[MIDI_CHANNELS] = {0};
+static unsigned short gPitchBendExplicit;
+static int gGamepadUsed;
+static int gPadAxesDirty;
+
+// Button changes and axis values pending for the next gamepad frame
+#define PAD_EVENTS_MAX 640
+static struct input_event gPadEvents[PAD_EVENTS_MAX];
+static int gPadEventCnt;
+static unsigned char gPadButtonInFrame[KEY_CNT];
+
+typedef struct MidiParserT
+{
+    unsigned char status;
+    unsigned char data[2];
+    int dataCnt;
+} MIDI_PARSER_T;
+static MIDI_PARSER_T gParser;
+
+#define REPEAT_OPTION_PREFIX "REPEAT:"
+#define REPEAT_MAX_RATE_HZ 100
+#define MAX_HELD_NOTES (16 * 128)
+
+// Held notes with auto-repeat, ordered by next deadline in a min-heap
+typedef struct RepeatEntryT
+{
+    long long deadline;
+    const struct KeymapNodeT *action;
+    int slot;
+} REPEAT_ENTRY_T;
+static REPEAT_ENTRY_T gRepeatHeap[MAX_HELD_NOTES];
+static int gRepeatHeapCnt;
+// Heap index + 1 for each channel/note slot, 0 when not repeating
+static int gRepeatHeapPos[MAX_HELD_NOTES];
+static long long gRepeatArmedDeadline;
+// Also wakes the loop to write paced keyboard output, see kb_flush()
+static int gRepeatTimerFd = -1;
+
+#define PROGRAM_ACTION_PREFIX "DO:"
+#define VM_STACK_DEPTH 16
+#define VM_REGISTERS 32
+#define VM_MAX_NESTING 8
+#define VM_MAX_CODE (2 * KEYMAP_LINE_MAX + 8)
+
+typedef enum
+{
+    OP_END,
+    OP_EMIT,        // u16 first event, u16 event count
+    OP_PRESS,       // As OP_EMIT, also marking the keys as held
+    OP_RELEASE,     // As OP_EMIT, also marking the keys as released
+    OP_MIDI,        // u8 length, then the bytes to send
+    OP_PUSH,        // s16 value
+    OP_LOAD,        // u8 register
+    OP_STORE,       // u8 register
+    OP_TOGGLE,      // u8 register, pushes the new value
+    OP_INC,         // u8 register, pushes the new value
+    OP_DEC,         // u8 register, pushes the new value
+    OP_LAYER,
+    OP_SETLAYER,
+    OP_HELD,        // u16 key code
+    OP_EQ,
+    OP_LT,
+    OP_GT,
+    OP_MOD,
+    OP_AND,
+    OP_OR,
+    OP_NOT,
+    OP_JZ,          // u16 target
+    OP_JMP,         // u16 target
+    OP_EXEC,        // u16 index into gExecCommands
+} VM_OPCODE_T;
+
+struct vm_ops_t {
+    const char *ascii;
+    int opcode;
+    int pops;
+    int pushes;
+};
+
+// Statements without an argument that map directly to one opcode
+const struct vm_ops_t VM_SIMPLE_OPS[] = {
+//  {ascii,         opcode,         pops,   pushes  },
+    {"LAYER",       OP_LAYER,       0,      1       },
+    {"EQ",          OP_EQ,          2,      1       },
+    {"LT",          OP_LT,          2,      1       },
+    {"GT",          OP_GT,          2,      1       },
+    {"MOD",         OP_MOD,         2,      1       },
+    {"AND",         OP_AND,         2,      1       },
+    {"OR",          OP_OR,          2,      1       },
+    {"NOT",         OP_NOT,         1,      1       },
+};
+
+// State shared by every program
+static int gVmRegisters[VM_REGISTERS];
+static int gVmLayer;
+static unsigned char gVmHeldKeys[KEY_CNT];
+static int gMidiFeedbackUsed;
+
+#define EXEC_ACTION_PREFIX "EXEC:"
+
+// Commands for EXEC actions, handed to workers by index
+static const char *gExecCommands[EXEC_MAX_COMMANDS];
+static int gExecCommandCnt;
+
+typedef struct ExecPoolT
+{
+    int jobFd[2];
+    int resultFd[2];
+    pid_t workers[EXEC_MAX_WORKERS];
+    int workerCnt;
+    // Queue depth is submitted - completed
+    unsigned int submitted;
+    unsigned int completed;
+    unsigned int failed;
+    unsigned int dropped;
+    unsigned int maxDepth;
+} EXEC_POOL_T;
+static EXEC_POOL_T gExecPool = { .jobFd = { -1, -1 }, .resultFd = { -1, -1 } };
+
+// Keyboard frames waiting to be written. Each write is kept well within the
+// 64 event evdev client buffer and the rest of a long TYPE: string is
+// dripped out from the repeat timer, so readers never see SYN_DROPPED.
+#define KB_OUT_MAX (2 * MAX_ACTION_EVENTS)
+#define KB_WRITE_MAX 32
+#define KB_PACE_NS 2000000LL
+static struct input_event gKbOut[KB_OUT_MAX];
+static int gKbOutHead;
+static int gKbOutCnt;
+// When the next chunk may be written, 0 when nothing is being paced
+static long long gKbPaceDeadline;
+
+// All keymap storage is carved from one block sized before parsing
+typedef struct ArenaT
+{
+    char *base;
+    size_t size;
+    size_t used;
+} ARENA_T;
+static ARENA_T gKeymapArena;
+
+#define ARENA_ALIGN (sizeof(long long))
+#define ARENA_ALIGNED(size) (((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
 typedef struct KeymapNodeT
 {
-    struct KeymapNodeT *pNext;
     unsigned char key;
+    int channel;
     char *action;
+    // Gamepad button held while the note is down, 0 for keyboard actions
+    int button;
+    // Auto-repeat while held, disabled when repeatIntervalNs is 0
+    long long repeatDelayNs;
+    long long repeatIntervalNs;
+    // Bytecode run on every trigger, see compile_program()
+    unsigned char *code;
+    int codeLen;
+    // Precompiled frames referenced by the bytecode
+    struct input_event *events;
+    int eventCnt;
 } KEYMAP_NODE_T;
-KEYMAP_NODE_T *gKeymapRoot = NULL;
+// Dispatch table with omni entries already expanded to every channel
+const KEYMAP_NODE_T *gKeymapTable[MIDI_CHANNELS][128] = {0};
 
 
 static void error(const char *format, ...)
@@ -175,7 +547,12 @@ static void usage(void)
         "                               for the specified duration\n"
         "-a, --active-sensing           include active sensing bytes\n"
         "-c, --clock                    include clock bytes\n"
-        "-i, --sysex-interval=mseconds  delay in between each SysEx message\n");
+        "-i, --sysex-interval=mseconds  delay in between each SysEx message\n"
+        "-w, --exec-workers=count       processes running EXEC actions (default 2)\n"
+        "    --selftest-latency[=count] measure MIDI to evdev latency and exit\n"
+        "    --benchmark[=baseline]     run microbenchmarks, comparing to a baseline\n"
+        "    --benchmark-save=file      write benchmark results as a new baseline\n"
+        "    --benchmark-threshold=pct  allowed slowdown against the baseline\n");
 }
 
 
@@ -185,447 +562,2648 @@ static void version(void)
 }
 
 
-static int load_keymap(char *keymap_file)
+static int find_key(const char *key)
 {
-    FILE *km_file = fopen(keymap_file, "r");
-    if (km_file == NULL)
-    {
-        printf("Failed to open %s for reading!\n", keymap_file);
-        return -1;
-    }
-    char line[160];
-    unsigned char midi_key;
-    char *action;
-
-    KEYMAP_NODE_T **pNextNodePtr = &gKeymapRoot;
-
-    while (fgets(line, sizeof(line), km_file) != NULL)
+    for (int keyIdx = 0; keyIdx < KEY_COUNT; keyIdx++)
     {
-        if (line[strlen(line)-1] == '\n')
-        {
-            line[strlen(line)-1] = '\x00';
-        }
-        if (line[0] == '#')
-        {
-            continue;
-        }
-        midi_key = strtol(strtok(line, ","), NULL, 0);
-        action = strtok(NULL, ",");
-        if (midi_key == 0 || action == NULL)
+        if (strcmp(SUPPORTED_KEYS_ARRAY[keyIdx].ascii, key) == 0)
         {
-            continue;
+            return SUPPORTED_KEYS_ARRAY[keyIdx].keyCode;
         }
-
-        KEYMAP_NODE_T *nextNode = (KEYMAP_NODE_T*)calloc(1, sizeof(KEYMAP_NODE_T));
-        nextNode->key = midi_key;
-        nextNode->action = (char*)calloc(1, strlen(action));
-        strcpy(nextNode->action, action);
-
-        *pNextNodePtr = nextNode;
-        pNextNodePtr = &nextNode->pNext;
-
-        printf("Loaded key=%#x, action=%s\n", midi_key, action);
     }
-    fclose(km_file);
+    return -1;
+}
 
-    return 0;
+
+static int str_key_to_event(char *key)
+{
+    int result = find_key(key);
+    printf("%s=%#x; ", key, result);
+    return result;
 }
 
-static const char* keymap_get_action(unsigned char key)
+
+static int char_to_event(char c, int *shift)
 {
-    if (gKeymapRoot == NULL)
+    if (isalnum((unsigned char)c))
     {
-        // No keymap loaded
-        return NULL;
+        char ascii[2] = { toupper((unsigned char)c), '\x00' };
+        *shift = isupper((unsigned char)c) != 0;
+        return find_key(ascii);
     }
-
-    const char *action = NULL;
-    KEYMAP_NODE_T *currentNode = gKeymapRoot;
-    do
+    for (int symIdx = 0; symIdx < SYMBOL_COUNT; symIdx++)
     {
-        if (currentNode->key == key)
+        if (TYPEABLE_SYMBOLS_ARRAY[symIdx].ascii == c)
         {
-            action = currentNode->action;
+            *shift = TYPEABLE_SYMBOLS_ARRAY[symIdx].shift;
+            return TYPEABLE_SYMBOLS_ARRAY[symIdx].keyCode;
         }
-    } while ((currentNode = currentNode->pNext) && !action);
-
-    return action;
+    }
+    return -1;
 }
 
 
-static int initialize_kb(void)
+static long long monotonic_ns(void)
 {
-    int kbFd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-    if (kbFd == -1)
-    {
-        return kbFd;
-    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
 
-    ioctl(kbFd, UI_SET_EVBIT, EV_KEY);
-    for (int keyIdx; keyIdx < KEY_COUNT; keyIdx++)
+
+static void* arena_alloc(ARENA_T *arena, size_t size)
+{
+    size = ARENA_ALIGNED(size);
+    if (arena->used + size > arena->size)
     {
-        ioctl(kbFd, UI_SET_KEYBIT, SUPPORTED_KEYS_ARRAY[keyIdx].keyCode);
+        printf("Keymap arena exhausted\n");
+        return NULL;
     }
-
-    struct uinput_setup usetup = {0};
-    usetup.id.bustype = BUS_USB;
-    usetup.id.vendor = 0x1234;
-    usetup.id.product = 0x5678;
-    strcpy(usetup.name, "MIDI virtual keyboard device");
-    ioctl(kbFd, UI_DEV_SETUP, &usetup);
-    ioctl(kbFd, UI_DEV_CREATE);
-
-    return kbFd;
+    void *ptr = arena->base + arena->used;
+    arena->used += size;
+    return ptr;
 }
 
 
-static void close_kb(int kbFd)
+static void set_event(struct input_event *evt, int type, int code, int value)
 {
-    ioctl(kbFd, UI_DEV_DESTROY);
-    close(kbFd);
+    memset(evt, 0, sizeof(*evt));
+    evt->type = type;
+    evt->code = code;
+    evt->value = value;
 }
 
 
-static int str_key_to_event(char *key)
+/*
+ * Builds a press frame and a release frame for a combination such as CTRL+C.
+ * Returns the number of events written to events, or -1 on error.
+ */
+static int compile_combo(char *action, struct input_event *events)
 {
-    int result = -1;
-    for (int keyIdx = 0; keyIdx < KEY_COUNT; keyIdx++)
+    int keys[MAX_COMBO_KEYS] = {0};
+    int keyCnt = 0;
+    int eventCnt = 0;
+    char *next_key = strtok(action, "+");
+    printf("Tokens: ");
+    while (next_key != NULL)
     {
-        if (strcmp(SUPPORTED_KEYS_ARRAY[keyIdx].ascii, key) == 0)
+        int next_evt = str_key_to_event(next_key);
+
+        if (next_evt != -1 && keyCnt < MAX_COMBO_KEYS)
         {
-            result = SUPPORTED_KEYS_ARRAY[keyIdx].keyCode;
-            break;
+            keys[keyCnt++] = next_evt;
         }
+        next_key = strtok(NULL, "+");
     }
-    printf("%s=%#x; ", key, result);
-    return result;
+    printf("\n");
+
+    if (keyCnt == 0)
+    {
+        return -1;
+    }
+    for (int emitValue = 1; emitValue >= 0; emitValue--)
+    {
+        for (int keyIdx = 0; keyIdx < keyCnt; keyIdx++)
+        {
+            set_event(&events[eventCnt++], EV_KEY, keys[keyIdx], emitValue);
+        }
+        set_event(&events[eventCnt++], EV_SYN, SYN_REPORT, 0);
+    }
+    return eventCnt;
 }
 
 
-static void emit_key(int kbFd, char *keys, int keyCnt)
+/*
+ * Expands TYPE:"text" into one press/release frame pair per character,
+ * wrapping shifted characters in SHIFT. Supports \n, \t, \\ and \" escapes.
+ */
+static int compile_type(const char *action, struct input_event *events)
 {
-    struct input_event reportEvt = {0};
-    reportEvt.type = EV_SYN;
-    reportEvt.code = SYN_REPORT;
-    reportEvt.value = 0;
-    reportEvt.time.tv_sec = 0;
-    reportEvt.time.tv_usec = 0;
+    const char *text = action + strlen(TYPE_ACTION_PREFIX);
+    int eventCnt = 0;
 
-    for (int emitValue = 1; emitValue >= 0; emitValue--)
+    if (*text++ != '"')
+    {
+        printf("TYPE action must be quoted: %s\n", action);
+        return -1;
+    }
+    for (; *text != '"'; text++)
     {
-        for (int inputKeyIdx = 0; inputKeyIdx < keyCnt; inputKeyIdx++)
+        char c = *text;
+        int shift = 0;
+        if (c == '\x00')
         {
-            struct input_event keyEvt = {0};
-            keyEvt.type = EV_KEY;
-            keyEvt.code = keys[inputKeyIdx];
-            keyEvt.value = emitValue;
-            keyEvt.time.tv_sec = 0;
-            keyEvt.time.tv_usec = 0;
-            write(kbFd, &keyEvt, sizeof(keyEvt));
+            printf("Unterminated TYPE action: %s\n", action);
+            return -1;
+        }
+        if (c == '\\')
+        {
+            switch (*++text)
+            {
+            case 'n':
+                c = '\n';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case '\\':
+            case '"':
+                c = *text;
+                break;
+            default:
+                printf("Unknown escape in TYPE action: %s\n", action);
+                return -1;
+            }
         }
-        write(kbFd, &reportEvt, sizeof(reportEvt));
 
+        int keyCode = char_to_event(c, &shift);
+        if (keyCode == -1)
+        {
+            printf("Cannot type character '%c'\n", c);
+            return -1;
+        }
+        if (shift)
+        {
+            set_event(&events[eventCnt++], EV_KEY, KEY_LEFTSHIFT, 1);
+        }
+        set_event(&events[eventCnt++], EV_KEY, keyCode, 1);
+        set_event(&events[eventCnt++], EV_SYN, SYN_REPORT, 0);
+        set_event(&events[eventCnt++], EV_KEY, keyCode, 0);
+        if (shift)
+        {
+            set_event(&events[eventCnt++], EV_KEY, KEY_LEFTSHIFT, 0);
+        }
+        set_event(&events[eventCnt++], EV_SYN, SYN_REPORT, 0);
     }
+    return eventCnt > 0 ? eventCnt : -1;
 }
 
-static void perform_action(int kbFd, const char *action)
+
+static int compile_action(const char *action, struct input_event *events)
 {
-    char *actionCpy = (char*)malloc(strlen(action));
-    strcpy(actionCpy, action);
-    char events[10] = {0};
-    int event_cnt = 0;
-    char *next_key = strtok(actionCpy, "+");
-    printf("Tokens: ");
-    while (next_key != NULL)
+    if (strncmp(action, TYPE_ACTION_PREFIX, strlen(TYPE_ACTION_PREFIX)) == 0)
     {
-        char next_evt = str_key_to_event(next_key);
+        return compile_type(action, events);
+    }
+
+    char actionCpy[KEYMAP_LINE_MAX];
+    strcpy(actionCpy, action);
+    return compile_combo(actionCpy, events);
+}
+
+
+static int vm_put_u16(unsigned char *code, int pos, int value)
+{
+    code[pos] = value & 0xff;
+    code[pos + 1] = (value >> 8) & 0xff;
+    return pos + 2;
+}
+
+
+static inline int vm_get_u16(const unsigned char *code, int pos)
+{
+    return code[pos] | (code[pos + 1] << 8);
+}
+
 
-        if (next_evt != -1)
+/*
+ * Terminates statement at the first ';' outside of quotes and returns the
+ * next statement, or NULL if there is none.
+ */
+static char* split_statement(char *statement)
+{
+    int quoted = 0;
+    for (char *c = statement; *c != '\x00'; c++)
+    {
+        if (*c == '\\' && quoted && c[1] != '\x00')
         {
-            events[event_cnt++] = next_evt;
+            c++;
+        }
+        else if (*c == '"')
+        {
+            quoted = !quoted;
+        }
+        else if (*c == ';' && !quoted)
+        {
+            *c = '\x00';
+            return c + 1;
         }
-        next_key = strtok(NULL, "+");
     }
-    printf("\n");
-
-    emit_key(kbFd, events, event_cnt);
+    return NULL;
 }
 
 
-static void list_device(snd_ctl_t *ctl, int card, int device)
+/*
+ * Copies an optionally quoted command into the keymap arena and emits the
+ * OP_EXEC that queues it.
+ */
+static int compile_exec(const char *command, unsigned char *code, int codeLen)
 {
-    snd_rawmidi_info_t *info;
-    const char *name;
-    const char *sub_name;
-    int subs, subs_in, subs_out;
-    int sub;
-    int err;
-
-    snd_rawmidi_info_alloca(&info);
-    snd_rawmidi_info_set_device(info, device);
+    size_t commandLen = strlen(command);
 
-    snd_rawmidi_info_set_stream(info, SND_RAWMIDI_STREAM_INPUT);
-    err = snd_ctl_rawmidi_info(ctl, info);
-    if (err >= 0)
-        subs_in = snd_rawmidi_info_get_subdevices_count(info);
-    else
-        subs_in = 0;
+    if (command[0] == '"' && commandLen >= 2 && command[commandLen - 1] == '"')
+    {
+        command++;
+        commandLen -= 2;
+    }
+    if (commandLen == 0 || gExecCommandCnt == EXEC_MAX_COMMANDS)
+    {
+        printf("Invalid or too many EXEC commands\n");
+        return -1;
+    }
+    char *commandCpy = (char*)arena_alloc(&gKeymapArena, commandLen + 1);
+    if (commandCpy == NULL)
+    {
+        return -1;
+    }
+    memcpy(commandCpy, command, commandLen);
+    commandCpy[commandLen] = '\x00';
+    gExecCommands[gExecCommandCnt] = commandCpy;
 
-    snd_rawmidi_info_set_stream(info, SND_RAWMIDI_STREAM_OUTPUT);
-    err = snd_ctl_rawmidi_info(ctl, info);
-    if (err >= 0)
-        subs_out = snd_rawmidi_info_get_subdevices_count(info);
-    else
-        subs_out = 0;
+    code[codeLen++] = OP_EXEC;
+    return vm_put_u16(code, codeLen, gExecCommandCnt++);
+}
 
-    subs = subs_in > subs_out ? subs_in : subs_out;
-    if (!subs)
-        return;
 
-    for (sub = 0; sub < subs; ++sub) {
-        snd_rawmidi_info_set_stream(info, sub < subs_in ?
-                        SND_RAWMIDI_STREAM_INPUT :
-                        SND_RAWMIDI_STREAM_OUTPUT);
-        snd_rawmidi_info_set_subdevice(info, sub);
-        err = snd_ctl_rawmidi_info(ctl, info);
-        if (err < 0) {
-            error("cannot get rawmidi information %d:%d:%d: %s\n",
-                  card, device, sub, snd_strerror(err));
-            return;
+/*
+ * Compiles a DO: program into bytecode, with the frames of every KEY, PRESS
+ * and RELEASE statement appended to events. Statements are separated by ';':
+ *   KEY <action>      tap a combination or TYPE:"text"
+ *   PRESS <combo>     press and hold, RELEASE <combo> lets go
+ *   MIDI <byte>...    send bytes back to the MIDI port
+ *   EXEC <command>    run a shell command on the worker pool
+ *   PUSH n, LOAD r, STORE r, SET r n, TOGGLE r, INC r, DEC r
+ *   LAYER, SETLAYER [n], HELD <key>
+ *   EQ, LT, GT, MOD, AND, OR, NOT
+ *   IF ... [ELSE ...] END
+ * Jumps only go forward, so the deepest stack any path can reach is tracked
+ * here and programs that could overflow are rejected.
+ * Returns the code length, or -1 on error.
+ */
+static int compile_program(const char *program, unsigned char *code,
+                           struct input_event *events, int *eventCnt)
+{
+    char text[KEYMAP_LINE_MAX];
+    char *statement = text;
+    int branches[VM_MAX_NESTING];
+    // Stack depth on entry to each open IF and at the end of the path that
+    // skips the current branch
+    int branchDepth[VM_MAX_NESTING];
+    int joinDepth[VM_MAX_NESTING];
+    int elseSeen[VM_MAX_NESTING];
+    int branchCnt = 0;
+    int codeLen = 0;
+    int depth = 0;
+    int maxDepth = 0;
+
+// Popping an empty stack yields 0 without changing the depth
+#define VM_EFFECT(pops, pushes) do { \
+        depth = (depth > (pops) ? depth - (pops) : 0) + (pushes); \
+        maxDepth = depth > maxDepth ? depth : maxDepth; \
+    } while (0)
+
+    strcpy(text, program + strlen(PROGRAM_ACTION_PREFIX));
+    while (statement != NULL)
+    {
+        char *next = split_statement(statement);
+        char *keyword = statement + strspn(statement, " \t");
+        char *arg = keyword + strcspn(keyword, " \t");
+        if (*arg != '\x00')
+        {
+            *arg++ = '\x00';
+            arg += strspn(arg, " \t");
         }
-        name = snd_rawmidi_info_get_name(info);
-        sub_name = snd_rawmidi_info_get_subdevice_name(info);
-        if (sub == 0 && sub_name[0] == '\0') {
-            printf("%c%c  hw:%d,%d    %s",
-                   sub < subs_in ? 'I' : ' ',
-                   sub < subs_out ? 'O' : ' ',
-                   card, device, name);
-            if (subs > 1)
-                printf(" (%d subdevices)", subs);
-            putchar('\n');
-            break;
-        } else {
-            printf("%c%c  hw:%d,%d,%d  %s\n",
-                   sub < subs_in ? 'I' : ' ',
-                   sub < subs_out ? 'O' : ' ',
-                   card, device, sub, sub_name);
+        arg[strcspn(arg, "\r")] = '\x00';
+        for (char *end = arg + strlen(arg); end > arg && isspace((unsigned char)end[-1]); )
+        {
+            *--end = '\x00';
         }
+        statement = next;
+
+        const struct vm_ops_t *simpleOp = NULL;
+        for (int opIdx = 0; opIdx < ARRAY_LENGTH(VM_SIMPLE_OPS); opIdx++)
+        {
+            if (strcmp(VM_SIMPLE_OPS[opIdx].ascii, keyword) == 0)
+            {
+                simpleOp = &VM_SIMPLE_OPS[opIdx];
+            }
+        }
+        if (keyword[0] == '\x00')
+        {
+            continue;
+        }
+        else if (simpleOp != NULL)
+        {
+            code[codeLen++] = simpleOp->opcode;
+            VM_EFFECT(simpleOp->pops, simpleOp->pushes);
+        }
+        else if (strcmp(keyword, "KEY") == 0 || strcmp(keyword, "PRESS") == 0 ||
+                 strcmp(keyword, "RELEASE") == 0)
+        {
+            int first = *eventCnt;
+            int frameCnt = compile_action(arg, &events[first]);
+            if (frameCnt < 0)
+            {
+                return -1;
+            }
+            *eventCnt += frameCnt;
+            if (keyword[0] == 'K')
+            {
+                code[codeLen++] = OP_EMIT;
+            }
+            else if (strncmp(arg, TYPE_ACTION_PREFIX, strlen(TYPE_ACTION_PREFIX)) == 0)
+            {
+                printf("%s cannot be used with TYPE\n", keyword);
+                return -1;
+            }
+            else
+            {
+                // Combination frames are the press half followed by the release half
+                frameCnt /= 2;
+                first += keyword[0] == 'R' ? frameCnt : 0;
+                code[codeLen++] = keyword[0] == 'P' ? OP_PRESS : OP_RELEASE;
+            }
+            codeLen = vm_put_u16(code, codeLen, first);
+            codeLen = vm_put_u16(code, codeLen, frameCnt);
+        }
+        else if (strcmp(keyword, "EXEC") == 0)
+        {
+            codeLen = compile_exec(arg, code, codeLen);
+            if (codeLen < 0)
+            {
+                return -1;
+            }
+        }
+        else if (strcmp(keyword, "MIDI") == 0)
+        {
+            int lengthPos = codeLen + 1;
+            code[codeLen++] = OP_MIDI;
+            code[codeLen++] = 0;
+            for (char *byte = strtok(arg, " \t"); byte != NULL; byte = strtok(NULL, " \t"))
+            {
+                code[codeLen++] = strtol(byte, NULL, 0);
+                code[lengthPos]++;
+            }
+            gMidiFeedbackUsed = 1;
+        }
+        else if (strcmp(keyword, "PUSH") == 0)
+        {
+            code[codeLen++] = OP_PUSH;
+            codeLen = vm_put_u16(code, codeLen, (short)strtol(arg, NULL, 0));
+            VM_EFFECT(0, 1);
+        }
+        else if (strcmp(keyword, "SETLAYER") == 0)
+        {
+            if (*arg != '\x00')
+            {
+                code[codeLen++] = OP_PUSH;
+                codeLen = vm_put_u16(code, codeLen, (short)strtol(arg, NULL, 0));
+                VM_EFFECT(0, 1);
+            }
+            code[codeLen++] = OP_SETLAYER;
+            VM_EFFECT(1, 0);
+        }
+        else if (strcmp(keyword, "HELD") == 0)
+        {
+            int keyCode = find_key(arg);
+            if (keyCode == -1)
+            {
+                printf("Unknown key %s\n", arg);
+                return -1;
+            }
+            code[codeLen++] = OP_HELD;
+            codeLen = vm_put_u16(code, codeLen, keyCode);
+            VM_EFFECT(0, 1);
+        }
+        else if (strcmp(keyword, "SET") == 0)
+        {
+            char *value = arg + strcspn(arg, " \t");
+            long reg = strtol(arg, NULL, 0);
+            if (reg < 0 || reg >= VM_REGISTERS)
+            {
+                printf("Invalid register %.*s\n", (int)(value - arg), arg);
+                return -1;
+            }
+            code[codeLen++] = OP_PUSH;
+            codeLen = vm_put_u16(code, codeLen, (short)strtol(value, NULL, 0));
+            code[codeLen++] = OP_STORE;
+            code[codeLen++] = reg;
+            VM_EFFECT(0, 1);
+            VM_EFFECT(1, 0);
+        }
+        else if (strcmp(keyword, "LOAD") == 0 || strcmp(keyword, "STORE") == 0 ||
+                 strcmp(keyword, "TOGGLE") == 0 || strcmp(keyword, "INC") == 0 ||
+                 strcmp(keyword, "DEC") == 0)
+        {
+            long reg = strtol(arg, NULL, 0);
+            if (reg < 0 || reg >= VM_REGISTERS)
+            {
+                printf("Invalid register %s\n", arg);
+                return -1;
+            }
+            code[codeLen++] = keyword[0] == 'L' ? OP_LOAD :
+                              keyword[0] == 'S' ? OP_STORE :
+                              keyword[0] == 'T' ? OP_TOGGLE :
+                              keyword[0] == 'I' ? OP_INC : OP_DEC;
+            code[codeLen++] = reg;
+            if (keyword[0] == 'S')
+            {
+                VM_EFFECT(1, 0);
+            }
+            else
+            {
+                VM_EFFECT(0, 1);
+            }
+        }
+        else if (strcmp(keyword, "IF") == 0)
+        {
+            if (branchCnt == VM_MAX_NESTING)
+            {
+                printf("IF nested too deeply\n");
+                return -1;
+            }
+            code[codeLen++] = OP_JZ;
+            VM_EFFECT(1, 0);
+            branchDepth[branchCnt] = depth;
+            joinDepth[branchCnt] = depth;
+            elseSeen[branchCnt] = 0;
+            branches[branchCnt++] = codeLen;
+            codeLen = vm_put_u16(code, codeLen, 0);
+        }
+        else if (strcmp(keyword, "ELSE") == 0 && branchCnt > 0)
+        {
+            if (elseSeen[branchCnt - 1])
+            {
+                printf("IF with more than one ELSE\n");
+                return -1;
+            }
+            elseSeen[branchCnt - 1] = 1;
+            code[codeLen++] = OP_JMP;
+            codeLen = vm_put_u16(code, codeLen, 0);
+            vm_put_u16(code, branches[branchCnt - 1], codeLen);
+            branches[branchCnt - 1] = codeLen - 2;
+            joinDepth[branchCnt - 1] = depth;
+            depth = branchDepth[branchCnt - 1];
+        }
+        else if (strcmp(keyword, "END") == 0 && branchCnt > 0)
+        {
+            vm_put_u16(code, branches[--branchCnt], codeLen);
+            depth = joinDepth[branchCnt] > depth ? joinDepth[branchCnt] : depth;
+        }
+        else
+        {
+            printf("Unknown statement %s\n", keyword);
+            return -1;
+        }
+    }
+#undef VM_EFFECT
+    if (branchCnt > 0)
+    {
+        printf("IF without END\n");
+        return -1;
+    }
+    if (maxDepth > VM_STACK_DEPTH)
+    {
+        printf("Program needs %d stack slots, at most %d are available\n", maxDepth, VM_STACK_DEPTH);
+        return -1;
+    }
+    code[codeLen++] = OP_END;
+    return codeLen;
+}
+
+
+/*
+ * Compiles any action. Plain combinations and TYPE: text become a program
+ * that emits their frames.
+ */
+static int compile_bytecode(const char *action, unsigned char *code,
+                            struct input_event *events, int *eventCnt)
+{
+    int codeLen = 0;
+
+    *eventCnt = 0;
+    if (strncmp(action, PROGRAM_ACTION_PREFIX, strlen(PROGRAM_ACTION_PREFIX)) == 0)
+    {
+        return compile_program(action, code, events, eventCnt);
+    }
+    if (strncmp(action, EXEC_ACTION_PREFIX, strlen(EXEC_ACTION_PREFIX)) == 0)
+    {
+        codeLen = compile_exec(action + strlen(EXEC_ACTION_PREFIX), code, codeLen);
+        if (codeLen < 0)
+        {
+            return -1;
+        }
+        code[codeLen++] = OP_END;
+        return codeLen;
+    }
+
+    *eventCnt = compile_action(action, events);
+    if (*eventCnt < 0)
+    {
+        return -1;
+    }
+    code[codeLen++] = OP_EMIT;
+    codeLen = vm_put_u16(code, codeLen, 0);
+    codeLen = vm_put_u16(code, codeLen, *eventCnt);
+    code[codeLen++] = OP_END;
+    return codeLen;
+}
+
+
+static int find_button(const char *button)
+{
+    for (int btnIdx = 0; btnIdx < BUTTON_COUNT; btnIdx++)
+    {
+        if (strcmp(SUPPORTED_BUTTONS_ARRAY[btnIdx].ascii, button) == 0)
+        {
+            return SUPPORTED_BUTTONS_ARRAY[btnIdx].keyCode;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Parses ABS_<axis>[:DEADZONE[:QUANTIZATION]] for a pitch bend or CC source.
+ * Returns the axis state the source should update, or NULL on error.
+ */
+static GAMEPAD_AXIS_T* load_abs_mapping(char *action)
+{
+    char *axisName = strtok(action, ":");
+    char *deadzone = strtok(NULL, ":");
+    char *quantization = strtok(NULL, ":");
+    GAMEPAD_AXIS_T *axis = NULL;
+
+    if (axisName == NULL)
+    {
+        printf("Missing axis\n");
+        return NULL;
+    }
+    for (int axisIdx = 0; axisIdx < ABS_AXIS_COUNT; axisIdx++)
+    {
+        if (strcmp(SUPPORTED_ABS_AXES_ARRAY[axisIdx].ascii, axisName) == 0)
+        {
+            axis = &gGamepadAxes[SUPPORTED_ABS_AXES_ARRAY[axisIdx].axis];
+            axis->axis = SUPPORTED_ABS_AXES_ARRAY[axisIdx].axis;
+        }
+    }
+    if (axis == NULL)
+    {
+        printf("Unknown axis %s\n", axisName);
+        return NULL;
+    }
+    axis->deadzone = deadzone != NULL ? abs(atoi(deadzone)) : 0;
+    axis->quantization = quantization != NULL ? atoi(quantization) : 1;
+    if (axis->quantization < 1)
+    {
+        axis->quantization = 1;
+    }
+    gGamepadUsed = 1;
+
+    printf("Loaded axis=%s, deadzone=%d, quantization=%d\n",
+           axisName, axis->deadzone, axis->quantization);
+    return axis;
+}
+
+
+/*
+ * Strips an optional @channel (1-16) from a source field.
+ * Returns the channel index, OMNI_CHANNEL if absent, or -2 if invalid.
+ */
+static int parse_source_channel(char *source)
+{
+    char *separator = strchr(source, CHANNEL_SEPARATOR);
+    if (separator == NULL)
+    {
+        return OMNI_CHANNEL;
+    }
+    *separator = '\x00';
+
+    char *endPtr;
+    long channel = strtol(separator + 1, &endPtr, 0);
+    if (endPtr == separator + 1 || channel < 1 || channel > MIDI_CHANNELS)
+    {
+        printf("Invalid channel %s\n", separator + 1);
+        return -2;
+    }
+    return channel - 1;
+}
+
+
+/*
+ * Channel specific entries always win over omni ones regardless of the order
+ * they appear in, otherwise the first entry for a cell wins.
+ */
+#define DISPATCH_CELL_FREE(cell, newChannel) \
+    ((cell) == NULL || ((cell)->channel == OMNI_CHANNEL && (newChannel) != OMNI_CHANNEL))
+
+static void keymap_table_insert(const KEYMAP_NODE_T *node)
+{
+    for (int channel = 0; channel < MIDI_CHANNELS; channel++)
+    {
+        if ((node->channel == OMNI_CHANNEL || node->channel == channel) &&
+            DISPATCH_CELL_FREE(gKeymapTable[channel][node->key], node->channel))
+        {
+            gKeymapTable[channel][node->key] = node;
+        }
+    }
+}
+
+
+static void cc_table_insert(CC_MAP_T *map)
+{
+    for (int channel = 0; channel < MIDI_CHANNELS; channel++)
+    {
+        if ((map->channel == OMNI_CHANNEL || map->channel == channel) &&
+            DISPATCH_CELL_FREE(gCcMap[channel][map->cc], map->channel))
+        {
+            gCcMap[channel][map->cc] = map;
+        }
+    }
+}
+
+
+static void pitch_bend_table_insert(GAMEPAD_AXIS_T *axis, int channel)
+{
+    for (int cell = 0; cell < MIDI_CHANNELS; cell++)
+    {
+        int cellExplicit = gPitchBendExplicit & (1 << cell);
+        if (channel == cell && (gPitchBendMap[cell] == NULL || !cellExplicit))
+        {
+            gPitchBendMap[cell] = axis;
+            gPitchBendExplicit |= 1 << cell;
+        }
+        else if (channel == OMNI_CHANNEL && gPitchBendMap[cell] == NULL)
+        {
+            gPitchBendMap[cell] = axis;
+        }
+    }
+}
+
+
+static int load_cc_mapping(char *source, char *action)
+{
+    int channel = parse_source_channel(source);
+    if (channel == -2)
+    {
+        return -1;
+    }
+
+    char *endPtr;
+    long cc = strtol(source + strlen(CC_SOURCE_PREFIX), &endPtr, 0);
+    if (endPtr == source + strlen(CC_SOURCE_PREFIX) || cc < 0 || cc > 127)
+    {
+        printf("Invalid control change %s\n", source);
+        return -1;
+    }
+
+    CC_MAP_T map = { .cc = cc, .channel = channel, .axis = -1, .mode = CC_MODE_ABS,
+                     .scale = 1.0f, .exponent = 1.0f, .lastValue = -1 };
+    if (strncmp(action, ABS_ACTION_PREFIX, strlen(ABS_ACTION_PREFIX)) == 0)
+    {
+        map.padAxis = load_abs_mapping(action);
+        if (map.padAxis == NULL)
+        {
+            return -1;
+        }
+        CC_MAP_T *nextMap = (CC_MAP_T*)arena_alloc(&gKeymapArena, sizeof(CC_MAP_T));
+        if (nextMap == NULL)
+        {
+            return -1;
+        }
+        *nextMap = map;
+        cc_table_insert(nextMap);
+        return 0;
+    }
+
+    char *axisName = strtok(action, ":");
+    char *modeName = strtok(NULL, ":");
+    char *scale = strtok(NULL, ":");
+    char *exponent = strtok(NULL, ":");
+
+    if (axisName == NULL)
+    {
+        printf("Missing axis for cc=0x%x\n", map.cc);
+        return -1;
+    }
+    for (int axisIdx = 0; axisIdx < REL_AXIS_COUNT; axisIdx++)
+    {
+        if (strcmp(SUPPORTED_REL_AXES_ARRAY[axisIdx].ascii, axisName) == 0)
+        {
+            map.axis = SUPPORTED_REL_AXES_ARRAY[axisIdx].axis;
+        }
+    }
+    if (map.axis == -1)
+    {
+        printf("Unknown axis %s\n", axisName);
+        return -1;
+    }
+    if (modeName != NULL)
+    {
+        int modeIdx;
+        for (modeIdx = 0; modeIdx < ARRAY_LENGTH(CC_MODE_NAMES); modeIdx++)
+        {
+            if (strcmp(CC_MODE_NAMES[modeIdx], modeName) == 0)
+            {
+                break;
+            }
+        }
+        if (modeIdx == ARRAY_LENGTH(CC_MODE_NAMES))
+        {
+            printf("Unknown control change mode %s\n", modeName);
+            return -1;
+        }
+        map.mode = modeIdx;
+    }
+    if (scale != NULL)
+    {
+        map.scale = atof(scale);
+    }
+    if (exponent != NULL)
+    {
+        map.exponent = atof(exponent);
+    }
+
+    CC_MAP_T *nextMap = (CC_MAP_T*)arena_alloc(&gKeymapArena, sizeof(CC_MAP_T));
+    if (nextMap == NULL)
+    {
+        return -1;
+    }
+    *nextMap = map;
+    nextMap->pNext = gCcMapRoot;
+    gCcMapRoot = nextMap;
+    cc_table_insert(nextMap);
+
+    printf("Loaded cc=%#lx, axis=%s, mode=%s, scale=%g, exponent=%g\n",
+           cc, axisName, CC_MODE_NAMES[map.mode], map.scale, map.exponent);
+    return 0;
+}
+
+
+/*
+ * Terminates action at the first comma outside of quotes and returns the
+ * remaining fields, or NULL if there are none.
+ */
+static char* split_action(char *action)
+{
+    int quoted = 0;
+    for (char *c = action; *c != '\x00'; c++)
+    {
+        if (*c == '\\' && quoted && c[1] != '\x00')
+        {
+            c++;
+        }
+        else if (*c == '"')
+        {
+            quoted = !quoted;
+        }
+        else if (*c == ',' && !quoted)
+        {
+            *c = '\x00';
+            return c + 1;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Parses REPEAT:DELAY_MS:RATE_HZ for a note mapping.
+ */
+static int load_repeat_option(KEYMAP_NODE_T *node, char *option)
+{
+    if (option == NULL)
+    {
+        return 0;
+    }
+    while (isspace((unsigned char)*option))
+    {
+        option++;
+    }
+    if (strncmp(option, REPEAT_OPTION_PREFIX, strlen(REPEAT_OPTION_PREFIX)) != 0)
+    {
+        printf("Unknown option %s\n", option);
+        return -1;
+    }
+
+    int delayMs = 0;
+    float rateHz = 0;
+    if (sscanf(option + strlen(REPEAT_OPTION_PREFIX), "%d:%f", &delayMs, &rateHz) != 2 ||
+        delayMs < 0 || rateHz <= 0 || rateHz > REPEAT_MAX_RATE_HZ)
+    {
+        printf("Invalid repeat option %s\n", option);
+        return -1;
+    }
+    node->repeatDelayNs = delayMs * 1000000LL;
+    node->repeatIntervalNs = NSEC_PER_SEC / rateHz;
+    return 0;
+}
+
+
+/*
+ * Upper bound of the arena space a keymap line needs, without compiling it.
+ */
+static size_t keymap_line_size(char *line)
+{
+    if (line[0] == '#')
+    {
+        return 0;
+    }
+    char *source = strtok(line, ",");
+    char *action = strtok(NULL, "");
+    if (source == NULL || action == NULL)
+    {
+        return 0;
+    }
+    if (strncmp(source, CC_SOURCE_PREFIX, strlen(CC_SOURCE_PREFIX)) == 0)
+    {
+        return ARENA_ALIGNED(sizeof(CC_MAP_T));
+    }
+
+    size_t actionLen = strlen(action);
+    size_t eventCnt;
+    if (strncmp(action, TYPE_ACTION_PREFIX, strlen(TYPE_ACTION_PREFIX)) == 0)
+    {
+        eventCnt = actionLen * EVENTS_PER_TYPED_CHAR;
+    }
+    else if (strncmp(action, PROGRAM_ACTION_PREFIX, strlen(PROGRAM_ACTION_PREFIX)) == 0)
+    {
+        // Quoted text is typed, anything else at most one event per character
+        int quoted = 0;
+        eventCnt = 0;
+        for (char *c = action; *c != '\x00'; c++)
+        {
+            if (quoted && *c == '\\' && c[1] != '\x00')
+            {
+                c++;
+            }
+            else
+            {
+                quoted ^= *c == '"';
+            }
+            eventCnt += quoted ? 2 * EVENTS_PER_TYPED_CHAR : 1;
+        }
+    }
+    else
+    {
+        size_t keyCnt = 1;
+        for (char *c = action; *c != '\x00'; c++)
+        {
+            keyCnt += *c == '+';
+        }
+        // Press and release of every key, each followed by a SYN
+        eventCnt = 2 * keyCnt + 2;
+    }
+    // No statement compiles to more than two bytes per character of source,
+    // and an EXEC command never needs more than three
+    return ARENA_ALIGNED(sizeof(KEYMAP_NODE_T)) + ARENA_ALIGNED(actionLen + 1) +
+           ARENA_ALIGNED(2 * actionLen + 8) +
+           (strstr(action, "EXEC") != NULL ? ARENA_ALIGNED(3 * actionLen) : 0) +
+           ARENA_ALIGNED(eventCnt * sizeof(struct input_event));
+}
+
+
+static int load_keymap_file(FILE *km_file)
+{
+    char line[KEYMAP_LINE_MAX];
+    unsigned char midi_key;
+    int channel;
+    char *source;
+    char *action;
+    char *option;
+    static struct input_event events[MAX_ACTION_EVENTS];
+    int eventCnt;
+    static unsigned char code[VM_MAX_CODE];
+    int codeLen;
+
+    size_t arenaSize = 0;
+    while (fgets(line, sizeof(line), km_file) != NULL)
+    {
+        arenaSize += keymap_line_size(line);
+    }
+    gKeymapArena.base = (char*)calloc(1, arenaSize > 0 ? arenaSize : 1);
+    gKeymapArena.size = arenaSize;
+    if (gKeymapArena.base == NULL)
+    {
+        return -1;
+    }
+    rewind(km_file);
+
+    while (fgets(line, sizeof(line), km_file) != NULL)
+    {
+        if (line[strlen(line)-1] == '\n')
+        {
+            line[strlen(line)-1] = '\x00';
+        }
+        if (line[0] == '#')
+        {
+            continue;
+        }
+        source = strtok(line, ",");
+        action = strtok(NULL, "");
+        if (source == NULL || action == NULL)
+        {
+            continue;
+        }
+        if (strncmp(source, CC_SOURCE_PREFIX, strlen(CC_SOURCE_PREFIX)) == 0)
+        {
+            action[strcspn(action, ",")] = '\x00';
+            load_cc_mapping(source, action);
+            continue;
+        }
+        channel = parse_source_channel(source);
+        if (channel == -2)
+        {
+            continue;
+        }
+        if (strcmp(source, PITCH_BEND_SOURCE) == 0)
+        {
+            action[strcspn(action, ",")] = '\x00';
+            GAMEPAD_AXIS_T *axis = load_abs_mapping(action);
+            if (axis != NULL)
+            {
+                pitch_bend_table_insert(axis, channel);
+            }
+            continue;
+        }
+        char *endPtr;
+        long note = strtol(source, &endPtr, 0);
+        if (endPtr == source)
+        {
+            continue;
+        }
+        if (note < 0 || note > 127)
+        {
+            printf("Invalid note %s\n", source);
+            continue;
+        }
+        midi_key = note;
+        option = split_action(action);
+
+        int button = 0;
+        if (strncmp(action, BUTTON_ACTION_PREFIX, strlen(BUTTON_ACTION_PREFIX)) == 0)
+        {
+            button = find_button(action);
+            eventCnt = 0;
+            codeLen = 0;
+            gGamepadUsed = 1;
+        }
+        else
+        {
+            codeLen = compile_bytecode(action, code, events, &eventCnt);
+        }
+        if (codeLen < 0 || button < 0)
+        {
+            printf("Skipping key=%#x, invalid action %s\n", midi_key, action);
+            continue;
+        }
+
+        KEYMAP_NODE_T node = {0};
+        if (button == 0 && load_repeat_option(&node, option) != 0)
+        {
+            printf("Skipping key=%#x, invalid option\n", midi_key);
+            continue;
+        }
+        KEYMAP_NODE_T *nextNode = (KEYMAP_NODE_T*)arena_alloc(&gKeymapArena, sizeof(KEYMAP_NODE_T));
+        char *actionCpy = (char*)arena_alloc(&gKeymapArena, strlen(action) + 1);
+        unsigned char *codeCpy = (unsigned char*)arena_alloc(&gKeymapArena, codeLen);
+        struct input_event *eventsCpy = (struct input_event*)arena_alloc(&gKeymapArena,
+                                                     eventCnt * sizeof(struct input_event));
+        if (nextNode == NULL || actionCpy == NULL || codeCpy == NULL || eventsCpy == NULL)
+        {
+            return -1;
+        }
+        *nextNode = node;
+        nextNode->key = midi_key;
+        nextNode->channel = channel;
+        nextNode->button = button;
+        nextNode->action = strcpy(actionCpy, action);
+        nextNode->code = memcpy(codeCpy, code, codeLen);
+        nextNode->codeLen = codeLen;
+        nextNode->events = memcpy(eventsCpy, events, eventCnt * sizeof(struct input_event));
+        nextNode->eventCnt = eventCnt;
+
+        keymap_table_insert(nextNode);
+
+        if (channel == OMNI_CHANNEL)
+        {
+            printf("Loaded key=%#x, action=%s\n", midi_key, action);
+        }
+        else
+        {
+            printf("Loaded key=%#x, channel=%d, action=%s\n", midi_key, channel + 1, action);
+        }
+    }
+
+    return 0;
+}
+
+
+static int load_keymap(char *keymap_file)
+{
+    FILE *km_file = fopen(keymap_file, "r");
+    if (km_file == NULL)
+    {
+        printf("Failed to open %s for reading!\n", keymap_file);
+        return -1;
+    }
+    int err = load_keymap_file(km_file);
+    fclose(km_file);
+
+    return err;
+}
+
+static inline const KEYMAP_NODE_T* keymap_get_action(unsigned char channel, unsigned char key)
+{
+    return gKeymapTable[channel][key];
+}
+
+
+static int initialize_kb(void)
+{
+    int kbFd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (kbFd == -1)
+    {
+        return kbFd;
+    }
+
+    ioctl(kbFd, UI_SET_EVBIT, EV_KEY);
+    ioctl(kbFd, UI_SET_EVBIT, EV_REL);
+    for (int axisIdx = 0; axisIdx < REL_AXIS_COUNT; axisIdx++)
+    {
+        ioctl(kbFd, UI_SET_RELBIT, SUPPORTED_REL_AXES_ARRAY[axisIdx].axis);
+    }
+    for (int keyIdx = 0; keyIdx < KEY_COUNT; keyIdx++)
+    {
+        ioctl(kbFd, UI_SET_KEYBIT, SUPPORTED_KEYS_ARRAY[keyIdx].keyCode);
+    }
+    for (int symIdx = 0; symIdx < SYMBOL_COUNT; symIdx++)
+    {
+        ioctl(kbFd, UI_SET_KEYBIT, TYPEABLE_SYMBOLS_ARRAY[symIdx].keyCode);
+    }
+
+    struct uinput_setup usetup = {0};
+    usetup.id.bustype = BUS_USB;
+    usetup.id.vendor = 0x1234;
+    usetup.id.product = 0x5678;
+    strcpy(usetup.name, "MIDI virtual keyboard device");
+    ioctl(kbFd, UI_DEV_SETUP, &usetup);
+    ioctl(kbFd, UI_DEV_CREATE);
+
+    return kbFd;
+}
+
+
+static void close_kb(int kbFd)
+{
+    ioctl(kbFd, UI_DEV_DESTROY);
+    close(kbFd);
+}
+
+
+static int initialize_gamepad(void)
+{
+    int padFd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (padFd == -1)
+    {
+        return padFd;
+    }
+
+    ioctl(padFd, UI_SET_EVBIT, EV_KEY);
+    for (int btnIdx = 0; btnIdx < BUTTON_COUNT; btnIdx++)
+    {
+        ioctl(padFd, UI_SET_KEYBIT, SUPPORTED_BUTTONS_ARRAY[btnIdx].keyCode);
+    }
+    ioctl(padFd, UI_SET_EVBIT, EV_ABS);
+    for (int axisIdx = 0; axisIdx < ABS_AXIS_COUNT; axisIdx++)
+    {
+        struct uinput_abs_setup absSetup = {0};
+        absSetup.code = SUPPORTED_ABS_AXES_ARRAY[axisIdx].axis;
+        absSetup.absinfo.minimum = GAMEPAD_AXIS_MIN;
+        absSetup.absinfo.maximum = GAMEPAD_AXIS_MAX;
+        absSetup.absinfo.flat = gGamepadAxes[absSetup.code].deadzone;
+        ioctl(padFd, UI_SET_ABSBIT, absSetup.code);
+        ioctl(padFd, UI_ABS_SETUP, &absSetup);
+    }
+
+    struct uinput_setup usetup = {0};
+    usetup.id.bustype = BUS_USB;
+    usetup.id.vendor = 0x1234;
+    usetup.id.product = 0x5679;
+    strcpy(usetup.name, "MIDI virtual gamepad device");
+    ioctl(padFd, UI_DEV_SETUP, &usetup);
+    ioctl(padFd, UI_DEV_CREATE);
+
+    return padFd;
+}
+
+
+typedef struct ExecJobT
+{
+    unsigned int seq;
+    unsigned short command;
+} EXEC_JOB_T;
+
+typedef struct ExecResultT
+{
+    unsigned int seq;
+    unsigned short command;
+    int status;
+} EXEC_RESULT_T;
+
+
+static void exec_worker(void)
+{
+    EXEC_JOB_T job;
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    while (read(gExecPool.jobFd[0], &job, sizeof(job)) == sizeof(job))
+    {
+        EXEC_RESULT_T result = { job.seq, job.command, -1 };
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            execl("/bin/sh", "sh", "-c", gExecCommands[job.command], (char*)NULL);
+            _exit(127);
+        }
+        if (pid == -1 || waitpid(pid, &result.status, 0) == -1)
+        {
+            result.status = -1;
+        }
+        write(gExecPool.resultFd[1], &result, sizeof(result));
+    }
+    _exit(0);
+}
+
+
+/*
+ * Forks the workers up front so the poll loop only ever writes a small job
+ * record to a pipe. Jobs and results are smaller than PIPE_BUF, so workers
+ * can share one job pipe without records interleaving. Each worker leads its
+ * own process group, which the commands it runs inherit, so stopping the
+ * pool reaches commands that are still running.
+ */
+static int exec_pool_start(int workerCnt)
+{
+    if (pipe2(gExecPool.jobFd, O_CLOEXEC) < 0 ||
+        pipe2(gExecPool.resultFd, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        error("cannot create exec pipes: %s", strerror(errno));
+        return -1;
+    }
+    // Submitting must never block the MIDI loop, full queues drop instead
+    fcntl(gExecPool.jobFd[1], F_SETFL, O_NONBLOCK);
+    // Dead workers surface as EPIPE from exec_submit() instead
+    signal(SIGPIPE, SIG_IGN);
+
+    fflush(stdout);
+    for (int workerIdx = 0; workerIdx < workerCnt; workerIdx++)
+    {
+        pid_t pid = fork();
+        if (pid == -1)
+        {
+            error("cannot start exec worker: %s", strerror(errno));
+            return -1;
+        }
+        if (pid == 0)
+        {
+            setpgid(0, 0);
+            close(gExecPool.jobFd[1]);
+            close(gExecPool.resultFd[0]);
+            exec_worker();
+        }
+        // Also set here so exec_pool_stop() cannot race the child
+        setpgid(pid, pid);
+        gExecPool.workers[gExecPool.workerCnt++] = pid;
+    }
+    close(gExecPool.jobFd[0]);
+    close(gExecPool.resultFd[1]);
+    return 0;
+}
+
+
+static void exec_pool_stop(void)
+{
+    if (gExecPool.workerCnt == 0)
+    {
+        return;
+    }
+    close(gExecPool.jobFd[1]);
+    close(gExecPool.resultFd[0]);
+    for (int workerIdx = 0; workerIdx < gExecPool.workerCnt; workerIdx++)
+    {
+        kill(-gExecPool.workers[workerIdx], SIGTERM);
+        waitpid(gExecPool.workers[workerIdx], NULL, 0);
+    }
+    printf("exec: %u submitted, %u completed, %u failed, %u dropped, max queue depth %u\n",
+           gExecPool.submitted, gExecPool.completed, gExecPool.failed,
+           gExecPool.dropped, gExecPool.maxDepth);
+}
+
+
+static void exec_submit(int command)
+{
+    EXEC_JOB_T job = { gExecPool.submitted, command };
+    unsigned int depth = gExecPool.submitted - gExecPool.completed;
+    ssize_t written = -1;
+
+    errno = EAGAIN;
+    if (depth < EXEC_QUEUE_MAX)
+    {
+        written = write(gExecPool.jobFd[1], &job, sizeof(job));
+    }
+    if (written != sizeof(job))
+    {
+        gExecPool.dropped++;
+        error("exec %s, dropped: %s", errno == EPIPE ? "workers gone" : "queue full",
+              gExecCommands[command]);
+        return;
+    }
+    gExecPool.submitted++;
+    if (depth + 1 > gExecPool.maxDepth)
+    {
+        gExecPool.maxDepth = depth + 1;
+    }
+}
+
+
+static void exec_collect(void)
+{
+    EXEC_RESULT_T result;
+
+    while (read(gExecPool.resultFd[0], &result, sizeof(result)) == sizeof(result))
+    {
+        gExecPool.completed++;
+        if (result.status == -1)
+        {
+            gExecPool.failed++;
+            error("exec could not run: %s", gExecCommands[result.command]);
+        }
+        else if (!WIFEXITED(result.status) || WEXITSTATUS(result.status) != 0)
+        {
+            gExecPool.failed++;
+            error("exec failed with status %d: %s",
+                  WIFEXITED(result.status) ? WEXITSTATUS(result.status) : -1,
+                  gExecCommands[result.command]);
+        }
+    }
+}
+
+
+/*
+ * Writes up to KB_WRITE_MAX queued events, ending on a frame boundary when
+ * possible. If more remain, the next chunk is due KB_PACE_NS later and
+ * repeat_service() writes it. Nothing is written while pacing is pending.
+ */
+static void kb_flush(int kbFd)
+{
+    if (gKbOutCnt == gKbOutHead || gKbPaceDeadline != 0)
+    {
+        return;
+    }
+    if (kbFd == -1)
+    {
+        gKbOutHead = gKbOutCnt = 0;
+        return;
+    }
+
+    int chunk = gKbOutCnt - gKbOutHead;
+    if (chunk > KB_WRITE_MAX)
+    {
+        chunk = KB_WRITE_MAX;
+        while (chunk > 1 && gKbOut[gKbOutHead + chunk - 1].type != EV_SYN)
+        {
+            chunk--;
+        }
+        if (chunk == 1 && gKbOut[gKbOutHead].type != EV_SYN)
+        {
+            chunk = KB_WRITE_MAX;
+        }
+    }
+    write(kbFd, &gKbOut[gKbOutHead], chunk * sizeof(struct input_event));
+    gKbOutHead += chunk;
+    if (gKbOutHead == gKbOutCnt)
+    {
+        gKbOutHead = gKbOutCnt = 0;
+    }
+    else
+    {
+        gKbPaceDeadline = monotonic_ns() + KB_PACE_NS;
+    }
+}
+
+
+/*
+ * Queues frames for the virtual keyboard so everything produced while
+ * handling one batch is written together, in paced chunks if it is long.
+ */
+static void kb_queue(int kbFd, struct input_event *events, int eventCnt)
+{
+    if (eventCnt > KB_OUT_MAX - (gKbOutCnt - gKbOutHead))
+    {
+        error("keyboard output backlog full, dropping %d events", eventCnt);
+        return;
+    }
+    if (gKbOutCnt + eventCnt > KB_OUT_MAX)
+    {
+        memmove(gKbOut, &gKbOut[gKbOutHead], (gKbOutCnt - gKbOutHead) * sizeof(struct input_event));
+        gKbOutCnt -= gKbOutHead;
+        gKbOutHead = 0;
+    }
+    memcpy(&gKbOut[gKbOutCnt], events, eventCnt * sizeof(struct input_event));
+    gKbOutCnt += eventCnt;
+}
+
+
+static void vm_mark_held(const struct input_event *events, int eventCnt, int held)
+{
+    for (int evtIdx = 0; evtIdx < eventCnt; evtIdx++)
+    {
+        if (events[evtIdx].type == EV_KEY)
+        {
+            gVmHeldKeys[events[evtIdx].code] = held;
+        }
+    }
+}
+
+
+/*
+ * Runs a compiled action. Programs are checked at load time, including their
+ * stack depth, so the stack bounds here are only a last line of defence.
+ */
+static void perform_action(int kbFd, const KEYMAP_NODE_T *action)
+{
+    const unsigned char *code = action->code;
+    int stack[VM_STACK_DEPTH];
+    int sp = 0;
+    int pc = 0;
+
+#define VM_POP() (sp > 0 ? stack[--sp] : 0)
+#define VM_PUSH(value) do { if (sp < VM_STACK_DEPTH) stack[sp++] = (value); } while (0)
+
+    for (;;)
+    {
+        unsigned char opcode = code[pc++];
+        int lhs, rhs;
+        switch (opcode)
+        {
+        case OP_END:
+            return;
+        case OP_EMIT:
+        case OP_PRESS:
+        case OP_RELEASE:
+        {
+            struct input_event *events = &action->events[vm_get_u16(code, pc)];
+            int eventCnt = vm_get_u16(code, pc + 2);
+            pc += 4;
+            kb_queue(kbFd, events, eventCnt);
+            if (opcode != OP_EMIT)
+            {
+                vm_mark_held(events, eventCnt, opcode == OP_PRESS);
+            }
+            break;
+        }
+        case OP_EXEC:
+            exec_submit(vm_get_u16(code, pc));
+            pc += 2;
+            break;
+        case OP_MIDI:
+            if (output != NULL)
+            {
+                snd_rawmidi_write(output, &code[pc + 1], code[pc]);
+            }
+            pc += 1 + code[pc];
+            break;
+        case OP_PUSH:
+            VM_PUSH((short)vm_get_u16(code, pc));
+            pc += 2;
+            break;
+        case OP_LOAD:
+            VM_PUSH(gVmRegisters[code[pc++]]);
+            break;
+        case OP_STORE:
+            gVmRegisters[code[pc++]] = VM_POP();
+            break;
+        case OP_TOGGLE:
+            gVmRegisters[code[pc]] = !gVmRegisters[code[pc]];
+            VM_PUSH(gVmRegisters[code[pc++]]);
+            break;
+        case OP_INC:
+            VM_PUSH(++gVmRegisters[code[pc++]]);
+            break;
+        case OP_DEC:
+            VM_PUSH(--gVmRegisters[code[pc++]]);
+            break;
+        case OP_LAYER:
+            VM_PUSH(gVmLayer);
+            break;
+        case OP_SETLAYER:
+            gVmLayer = VM_POP();
+            break;
+        case OP_HELD:
+            VM_PUSH(gVmHeldKeys[vm_get_u16(code, pc)]);
+            pc += 2;
+            break;
+        case OP_NOT:
+            lhs = VM_POP();
+            VM_PUSH(!lhs);
+            break;
+        case OP_EQ:
+        case OP_LT:
+        case OP_GT:
+        case OP_MOD:
+        case OP_AND:
+        case OP_OR:
+            rhs = VM_POP();
+            lhs = VM_POP();
+            VM_PUSH(opcode == OP_EQ ? lhs == rhs :
+                    opcode == OP_LT ? lhs < rhs :
+                    opcode == OP_GT ? lhs > rhs :
+                    opcode == OP_MOD ? (rhs != 0 ? lhs % rhs : 0) :
+                    opcode == OP_AND ? lhs && rhs : lhs || rhs);
+            break;
+        case OP_JZ:
+            pc = VM_POP() ? pc + 2 : vm_get_u16(code, pc);
+            break;
+        case OP_JMP:
+            pc = vm_get_u16(code, pc);
+            break;
+        }
+    }
+#undef VM_POP
+#undef VM_PUSH
+}
+
+
+static void list_device(snd_ctl_t *ctl, int card, int device)
+{
+    snd_rawmidi_info_t *info;
+    const char *name;
+    const char *sub_name;
+    int subs, subs_in, subs_out;
+    int sub;
+    int err;
+
+    snd_rawmidi_info_alloca(&info);
+    snd_rawmidi_info_set_device(info, device);
+
+    snd_rawmidi_info_set_stream(info, SND_RAWMIDI_STREAM_INPUT);
+    err = snd_ctl_rawmidi_info(ctl, info);
+    if (err >= 0)
+        subs_in = snd_rawmidi_info_get_subdevices_count(info);
+    else
+        subs_in = 0;
+
+    snd_rawmidi_info_set_stream(info, SND_RAWMIDI_STREAM_OUTPUT);
+    err = snd_ctl_rawmidi_info(ctl, info);
+    if (err >= 0)
+        subs_out = snd_rawmidi_info_get_subdevices_count(info);
+    else
+        subs_out = 0;
+
+    subs = subs_in > subs_out ? subs_in : subs_out;
+    if (!subs)
+        return;
+
+    for (sub = 0; sub < subs; ++sub) {
+        snd_rawmidi_info_set_stream(info, sub < subs_in ?
+                        SND_RAWMIDI_STREAM_INPUT :
+                        SND_RAWMIDI_STREAM_OUTPUT);
+        snd_rawmidi_info_set_subdevice(info, sub);
+        err = snd_ctl_rawmidi_info(ctl, info);
+        if (err < 0) {
+            error("cannot get rawmidi information %d:%d:%d: %s\n",
+                  card, device, sub, snd_strerror(err));
+            return;
+        }
+        name = snd_rawmidi_info_get_name(info);
+        sub_name = snd_rawmidi_info_get_subdevice_name(info);
+        if (sub == 0 && sub_name[0] == '\0') {
+            printf("%c%c  hw:%d,%d    %s",
+                   sub < subs_in ? 'I' : ' ',
+                   sub < subs_out ? 'O' : ' ',
+                   card, device, name);
+            if (subs > 1)
+                printf(" (%d subdevices)", subs);
+            putchar('\n');
+            break;
+        } else {
+            printf("%c%c  hw:%d,%d,%d  %s\n",
+                   sub < subs_in ? 'I' : ' ',
+                   sub < subs_out ? 'O' : ' ',
+                   card, device, sub, sub_name);
+        }
+    }
+}
+
+
+static void list_card_devices(int card)
+{
+    snd_ctl_t *ctl;
+    char name[32];
+    int device;
+    int err;
+
+    sprintf(name, "hw:%d", card);
+    if ((err = snd_ctl_open(&ctl, name, 0)) < 0) {
+        error("cannot open control for card %d: %s", card, snd_strerror(err));
+        return;
+    }
+    device = -1;
+    for (;;) {
+        if ((err = snd_ctl_rawmidi_next_device(ctl, &device)) < 0) {
+            error("cannot determine device number: %s", snd_strerror(err));
+            break;
+        }
+        if (device < 0)
+            break;
+        list_device(ctl, card, device);
+    }
+    snd_ctl_close(ctl);
+}
+
+
+static void device_list(void)
+{
+    int card, err;
+
+    card = -1;
+    if ((err = snd_card_next(&card)) < 0) {
+        error("cannot determine card number: %s", snd_strerror(err));
+        return;
+    }
+    if (card < 0) {
+        error("no sound card found");
+        return;
+    }
+    puts("Dir Device    Name");
+    do {
+        list_card_devices(card);
+        if ((err = snd_card_next(&card)) < 0) {
+            error("cannot determine card number: %s", snd_strerror(err));
+            break;
+        }
+    } while (card >= 0);
+}
+
+
+static void rawmidi_list(void)
+{
+    snd_output_t *output;
+    snd_config_t *config;
+    int err;
+
+    if ((err = snd_config_update()) < 0) {
+        error("snd_config_update failed: %s", snd_strerror(err));
+        return;
+    }
+    if ((err = snd_output_stdio_attach(&output, stdout, 0)) < 0) {
+        error("snd_output_stdio_attach failed: %s", snd_strerror(err));
+        return;
+    }
+    if (snd_config_search(snd_config, "rawmidi", &config) >= 0) {
+        puts("RawMIDI list:");
+        snd_config_save(config, output);
+    }
+    snd_output_close(output);
+}
+
+
+static int send_midi_interleaved(void)
+{
+    int err;
+    char *data = send_data;
+    size_t buffer_size;
+    snd_rawmidi_params_t *param;
+    snd_rawmidi_status_t *st;
+
+    snd_rawmidi_status_alloca(&st);
+
+    snd_rawmidi_params_alloca(&param);
+    snd_rawmidi_params_current(output, param);
+    buffer_size = snd_rawmidi_params_get_buffer_size(param);
+
+    while (data < (send_data + send_data_length)) {
+        int len = send_data + send_data_length - data;
+        char *temp;
+
+        if (data > send_data) {
+            snd_rawmidi_status(output, st);
+            do {
+                /* 320 µs per byte as noted in Page 1 of MIDI spec */
+                usleep((buffer_size - snd_rawmidi_status_get_avail(st)) * 320);
+                snd_rawmidi_status(output, st);
+            } while(snd_rawmidi_status_get_avail(st) < buffer_size);
+            usleep(sysex_interval * 1000);
+        }
+
+        /* find end of SysEx */
+        if ((temp = memchr(data, 0xf7, len)) != NULL)
+            len = temp - data + 1;
+
+        if ((err = snd_rawmidi_write(output, data, len)) < 0)
+            return err;
+
+        data += len;
+    }
+
+    return 0;
+}
+
+
+/*
+ * prints MIDI commands, formatting them nicely
+ */
+static void print_byte(unsigned char byte)
+{
+    static enum {
+        STATE_UNKNOWN,
+        STATE_1PARAM,
+        STATE_1PARAM_CONTINUE,
+        STATE_2PARAM_1,
+        STATE_2PARAM_2,
+        STATE_2PARAM_1_CONTINUE,
+        STATE_SYSEX
+    } state = STATE_UNKNOWN;
+    int newline = 0;
+
+    if (byte >= 0xf8)
+        newline = 1;
+    else if (byte >= 0xf0) {
+        newline = 1;
+        switch (byte) {
+        case 0xf0:
+            state = STATE_SYSEX;
+            break;
+        case 0xf1:
+        case 0xf3:
+            state = STATE_1PARAM;
+            break;
+        case 0xf2:
+            state = STATE_2PARAM_1;
+            break;
+        case 0xf4:
+        case 0xf5:
+        case 0xf6:
+            state = STATE_UNKNOWN;
+            break;
+        case 0xf7:
+            newline = state != STATE_SYSEX;
+            state = STATE_UNKNOWN;
+            break;
+        }
+    } else if (byte >= 0x80) {
+        newline = 1;
+        if (byte >= 0xc0 && byte <= 0xdf)
+            state = STATE_1PARAM;
+        else
+            state = STATE_2PARAM_1;
+    } else /* b < 0x80 */ {
+        int running_status = 0;
+        newline = state == STATE_UNKNOWN;
+        switch (state) {
+        case STATE_1PARAM:
+            state = STATE_1PARAM_CONTINUE;
+            break;
+        case STATE_1PARAM_CONTINUE:
+            running_status = 1;
+            break;
+        case STATE_2PARAM_1:
+            state = STATE_2PARAM_2;
+            break;
+        case STATE_2PARAM_2:
+            state = STATE_2PARAM_1_CONTINUE;
+            break;
+        case STATE_2PARAM_1_CONTINUE:
+            running_status = 1;
+            state = STATE_2PARAM_2;
+            break;
+        default:
+            break;
+        }
+        if (running_status)
+            fputs("\n  ", stdout);
+    }
+    printf("%c%02X", newline ? '\n' : ' ', byte);
+}
+
+static void cc_accumulate(CC_MAP_T *map, unsigned char value)
+{
+    switch (map->mode)
+    {
+    case CC_MODE_ABS:
+        if (map->lastValue != -1)
+        {
+            map->pendingDelta += value - map->lastValue;
+        }
+        map->lastValue = value;
+        break;
+    case CC_MODE_REL:
+        map->pendingDelta += value < 64 ? value : value - 128;
+        break;
+    case CC_MODE_OFS:
+        map->pendingDelta += value - 64;
+        break;
+    }
+    gRelDirty = 1;
+}
+
+
+/*
+ * Folds the deltas accumulated during one read batch into a single frame,
+ * carrying fractional movement over to the next batch.
+ */
+static int build_rel_frame(struct input_event *events)
+{
+    int relTotal[REL_CNT] = {0};
+    int eventCnt = 0;
+
+    for (CC_MAP_T *map = gCcMapRoot; map != NULL; map = map->pNext)
+    {
+        if (map->pendingDelta == 0)
+        {
+            continue;
+        }
+        float magnitude = map->scale * powf(abs(map->pendingDelta), map->exponent);
+        float moved = gRelRemainder[map->axis] +
+                      (map->pendingDelta < 0 ? -magnitude : magnitude);
+        relTotal[map->axis] += (int)moved;
+        gRelRemainder[map->axis] = moved - (int)moved;
+        map->pendingDelta = 0;
+    }
+    for (int axisIdx = 0; axisIdx < REL_AXIS_COUNT; axisIdx++)
+    {
+        int axis = SUPPORTED_REL_AXES_ARRAY[axisIdx].axis;
+        if (relTotal[axis] != 0)
+        {
+            set_event(&events[eventCnt++], EV_REL, axis, relTotal[axis]);
+        }
+    }
+    if (eventCnt > 0)
+    {
+        set_event(&events[eventCnt++], EV_SYN, SYN_REPORT, 0);
+    }
+    return eventCnt;
+}
+
+
+static void flush_rel(int kbFd)
+{
+    struct input_event events[REL_AXIS_COUNT + 1];
+
+    if (!gRelDirty)
+    {
+        return;
+    }
+    gRelDirty = 0;
+    kb_queue(kbFd, events, build_rel_frame(events));
+}
+
+
+static void repeat_heap_place(int pos, REPEAT_ENTRY_T *entry)
+{
+    gRepeatHeap[pos] = *entry;
+    gRepeatHeapPos[entry->slot] = pos + 1;
+}
+
+
+static void repeat_heap_sift(int pos)
+{
+    REPEAT_ENTRY_T entry = gRepeatHeap[pos];
+
+    while (pos > 0 && gRepeatHeap[(pos - 1) / 2].deadline > entry.deadline)
+    {
+        repeat_heap_place(pos, &gRepeatHeap[(pos - 1) / 2]);
+        pos = (pos - 1) / 2;
+    }
+    for (;;)
+    {
+        int child = 2 * pos + 1;
+        if (child >= gRepeatHeapCnt)
+        {
+            break;
+        }
+        if (child + 1 < gRepeatHeapCnt &&
+            gRepeatHeap[child + 1].deadline < gRepeatHeap[child].deadline)
+        {
+            child++;
+        }
+        if (gRepeatHeap[child].deadline >= entry.deadline)
+        {
+            break;
+        }
+        repeat_heap_place(pos, &gRepeatHeap[child]);
+        pos = child;
+    }
+    repeat_heap_place(pos, &entry);
+}
+
+
+static void repeat_start(int slot, const KEYMAP_NODE_T *action, long long now)
+{
+    REPEAT_ENTRY_T entry = { now + action->repeatDelayNs, action, slot };
+    int pos = gRepeatHeapPos[slot] - 1;
+
+    if (pos < 0)
+    {
+        pos = gRepeatHeapCnt++;
+    }
+    gRepeatHeap[pos] = entry;
+    repeat_heap_sift(pos);
+}
+
+
+static void repeat_stop(int slot)
+{
+    int pos = gRepeatHeapPos[slot] - 1;
+
+    if (pos < 0)
+    {
+        return;
+    }
+    gRepeatHeapPos[slot] = 0;
+    if (pos != --gRepeatHeapCnt)
+    {
+        gRepeatHeap[pos] = gRepeatHeap[gRepeatHeapCnt];
+        repeat_heap_sift(pos);
+    }
+}
+
+
+/*
+ * Points the timer at the earliest held note or paced keyboard chunk. Called
+ * once per batch so the timer is only reprogrammed when the deadline changed.
+ */
+static void repeat_arm_timer(void)
+{
+    long long deadline = gRepeatHeapCnt > 0 ? gRepeatHeap[0].deadline : 0;
+    struct itimerspec spec = { .it_interval = { 0, 0 } };
+
+    if (gKbPaceDeadline != 0 && (deadline == 0 || gKbPaceDeadline < deadline))
+    {
+        deadline = gKbPaceDeadline;
+    }
+    if (gRepeatTimerFd == -1 || deadline == gRepeatArmedDeadline)
+    {
+        return;
+    }
+    spec.it_value.tv_sec = deadline / NSEC_PER_SEC;
+    spec.it_value.tv_nsec = deadline % NSEC_PER_SEC;
+    if (timerfd_settime(gRepeatTimerFd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+    {
+        error("cannot set repeat timer: %s", strerror(errno));
+        return;
+    }
+    gRepeatArmedDeadline = deadline;
+}
+
+
+static void repeat_service(int kbFd)
+{
+    long long now = monotonic_ns();
+    unsigned long long expirations;
+
+    read(gRepeatTimerFd, &expirations, sizeof(expirations));
+    gRepeatArmedDeadline = 0;
+    while (gRepeatHeapCnt > 0 && gRepeatHeap[0].deadline <= now)
+    {
+        const KEYMAP_NODE_T *action = gRepeatHeap[0].action;
+        perform_action(kbFd, action);
+
+        // Skip missed repeats rather than bursting to catch up
+        gRepeatHeap[0].deadline += action->repeatIntervalNs;
+        if (gRepeatHeap[0].deadline <= now)
+        {
+            gRepeatHeap[0].deadline = now + action->repeatIntervalNs;
+        }
+        repeat_heap_sift(0);
+    }
+    if (gKbPaceDeadline != 0 && gKbPaceDeadline <= now)
+    {
+        gKbPaceDeadline = 0;
+    }
+    kb_flush(kbFd);
+    repeat_arm_timer();
+}
+
+
+static void flush_pad(int padFd)
+{
+    if (gPadAxesDirty)
+    {
+        for (int axisIdx = 0; axisIdx < ABS_AXIS_COUNT; axisIdx++)
+        {
+            GAMEPAD_AXIS_T *axis = &gGamepadAxes[SUPPORTED_ABS_AXES_ARRAY[axisIdx].axis];
+            if (axis->dirty && axis->latest != axis->emitted)
+            {
+                set_event(&gPadEvents[gPadEventCnt++], EV_ABS, axis->axis, axis->latest);
+                axis->emitted = axis->latest;
+            }
+            axis->dirty = 0;
+        }
+        gPadAxesDirty = 0;
+    }
+    if (gPadEventCnt == 0)
+    {
+        return;
+    }
+    set_event(&gPadEvents[gPadEventCnt++], EV_SYN, SYN_REPORT, 0);
+    if (padFd != -1)
+    {
+        write(padFd, gPadEvents, gPadEventCnt * sizeof(struct input_event));
+    }
+    gPadEventCnt = 0;
+    memset(gPadButtonInFrame, 0, sizeof(gPadButtonInFrame));
+}
+
+
+static void pad_button(int padFd, int button, int value)
+{
+    // A button changing twice in one frame would be lost, so split the frame
+    if (gPadButtonInFrame[button] || gPadEventCnt >= PAD_EVENTS_MAX - ABS_AXIS_COUNT - 2)
+    {
+        flush_pad(padFd);
+    }
+    set_event(&gPadEvents[gPadEventCnt++], EV_KEY, button, value);
+    gPadButtonInFrame[button] = 1;
+}
+
+
+/*
+ * Only the latest value of an axis within a batch is kept. Deadzone and
+ * quantization are applied here so imperceptible changes never dirty it.
+ */
+static void pad_axis(GAMEPAD_AXIS_T *axis, int value)
+{
+    if (abs(value) <= axis->deadzone)
+    {
+        value = 0;
+    }
+    if (axis->quantization > 1)
+    {
+        int half = axis->quantization / 2;
+        value = value >= 0 ? (value + half) / axis->quantization
+                           : -((-value + half) / axis->quantization);
+        value *= axis->quantization;
+    }
+    if (value < GAMEPAD_AXIS_MIN)
+    {
+        value = GAMEPAD_AXIS_MIN;
+    }
+    else if (value > GAMEPAD_AXIS_MAX)
+    {
+        value = GAMEPAD_AXIS_MAX;
+    }
+    axis->latest = value;
+    axis->dirty = 1;
+    gPadAxesDirty = 1;
+}
+
+
+static void dispatch_message(int kbFd, int padFd, unsigned char status, unsigned char *data)
+{
+    switch (status & 0xf0)
+    {
+    case MIDI_CMD_NOTE_ON:
+    case MIDI_CMD_NOTE_OFF:
+    {
+        const KEYMAP_NODE_T *action = keymap_get_action(status & 0x0f, data[0]);
+        int pressed = (status & 0xf0) == MIDI_CMD_NOTE_ON && data[1] != 0;
+        int slot = (status & 0x0f) * 128 + data[0];
+        if (action == NULL)
+        {
+            break;
+        }
+        if (action->button)
+        {
+            pad_button(padFd, action->button, pressed);
+        }
+        else if (pressed)
+        {
+            if (verbose)
+            {
+                printf("\nInput: %s\n", action->action);
+            }
+            perform_action(kbFd, action);
+            if (action->repeatIntervalNs)
+            {
+                repeat_start(slot, action, monotonic_ns());
+            }
+        }
+        else
+        {
+            repeat_stop(slot);
+        }
+        break;
+    }
+    case MIDI_CMD_CONTROL:
+    {
+        CC_MAP_T *map = gCcMap[status & 0x0f][data[0]];
+        if (map == NULL)
+        {
+            break;
+        }
+        if (map->padAxis != NULL)
+        {
+            pad_axis(map->padAxis, data[1] * (GAMEPAD_AXIS_MAX - GAMEPAD_AXIS_MIN) / 127
+                                   + GAMEPAD_AXIS_MIN);
+        }
+        else
+        {
+            cc_accumulate(map, data[1]);
+        }
+        break;
+    }
+    case MIDI_CMD_BENDER:
+        if (gPitchBendMap[status & 0x0f] != NULL)
+        {
+            pad_axis(gPitchBendMap[status & 0x0f], ((data[1] << 7) | data[0]) + GAMEPAD_AXIS_MIN);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+
+/*
+ * Drops clock and active sensing bytes in place unless requested.
+ */
+static int filter_realtime_bytes(unsigned char *buf, int bufLen, int ignore_clock,
+                                 int ignore_active_sensing)
+{
+    int length = 0;
+    for (int i = 0; i < bufLen; ++i)
+        if ((buf[i] != MIDI_CMD_COMMON_CLOCK &&
+             buf[i] != MIDI_CMD_COMMON_SENSING) ||
+            (buf[i] == MIDI_CMD_COMMON_CLOCK   && !ignore_clock) ||
+            (buf[i] == MIDI_CMD_COMMON_SENSING && !ignore_active_sensing))
+            buf[length++] = buf[i];
+    return length;
+}
+
+
+static void parse_rx_data(int kbFd, int padFd, unsigned char *buf, int bufLen)
+{
+    for (int currentIdx = 0; currentIdx < bufLen; currentIdx++)
+    {
+        unsigned char data = buf[currentIdx];
+        if (data >= 0xf8)
+        {
+            // Realtime bytes may appear anywhere and don't cancel running status
+            continue;
+        }
+        if (data >= 0xf0)
+        {
+            // System common and SysEx, no mappings use these
+            gParser.status = 0;
+            continue;
+        }
+        if (data >= 0x80)
+        {
+            gParser.status = data;
+            gParser.dataCnt = 0;
+            continue;
+        }
+        if (gParser.status == 0)
+        {
+            continue;
+        }
+
+        gParser.data[gParser.dataCnt++] = data;
+        unsigned char command = gParser.status & 0xf0;
+        int dataLen = (command == MIDI_CMD_PGM_CHANGE ||
+                       command == MIDI_CMD_CHANNEL_PRESSURE) ? 1 : 2;
+        if (gParser.dataCnt == dataLen)
+        {
+            dispatch_message(kbFd, padFd, gParser.status, gParser.data);
+            gParser.dataCnt = 0;
+        }
+    }
+    flush_rel(kbFd);
+    kb_flush(kbFd);
+    flush_pad(padFd);
+    repeat_arm_timer();
+}
+
+
+#define SELFTEST_DEFAULT_ITERATIONS 1000
+#define SELFTEST_WARMUP_ITERATIONS 10
+#define SELFTEST_NOTE 0x3c
+#define SELFTEST_TIMEOUT_MS 1000
+
+/*
+ * Finds and opens the evdev node that uinput created for devFd.
+ */
+static int open_uinput_evdev(int devFd)
+{
+    char sysname[64];
+    char path[PATH_MAX];
+
+    if (ioctl(devFd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0)
+    {
+        error("cannot get uinput device name: %s", strerror(errno));
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s", sysname);
+
+    // udev may take a moment to create the node after UI_DEV_CREATE
+    for (int attempt = 0; attempt < 100; attempt++)
+    {
+        DIR *dir = opendir(path);
+        struct dirent *entry;
+        while (dir != NULL && (entry = readdir(dir)) != NULL)
+        {
+            if (strncmp(entry->d_name, "event", strlen("event")) == 0)
+            {
+                char node[PATH_MAX];
+                snprintf(node, sizeof(node), "/dev/input/%s", entry->d_name);
+                int evFd = open(node, O_RDONLY | O_NONBLOCK);
+                if (evFd != -1)
+                {
+                    closedir(dir);
+                    return evFd;
+                }
+            }
+        }
+        if (dir != NULL)
+        {
+            closedir(dir);
+        }
+        usleep(10000);
+    }
+    error("cannot open event device for %s", sysname);
+    return -1;
+}
+
+
+/*
+ * Blocks until the press of the selftest key is delivered, returning the
+ * kernel timestamp of the event in evdevNs.
+ */
+static int wait_for_press(int evFd, int keyCode, long long *evdevNs)
+{
+    struct pollfd pfd = { .fd = evFd, .events = POLLIN };
+    struct input_event evt;
+
+    while (poll(&pfd, 1, SELFTEST_TIMEOUT_MS) > 0)
+    {
+        while (read(evFd, &evt, sizeof(evt)) == sizeof(evt))
+        {
+            if (evt.type == EV_KEY && evt.code == keyCode && evt.value == 1)
+            {
+                *evdevNs = evt.time.tv_sec * NSEC_PER_SEC + evt.time.tv_usec * 1000LL;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+
+static int compare_latency(const void *a, const void *b)
+{
+    long long lhs = *(const long long*)a;
+    long long rhs = *(const long long*)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+
+static void print_percentiles(const char *name, long long *samples, int sampleCnt)
+{
+    static const double PERCENTILES[] = { 50, 90, 99, 99.9 };
+
+    qsort(samples, sampleCnt, sizeof(long long), compare_latency);
+    printf("%-8s", name);
+    for (int pctIdx = 0; pctIdx < ARRAY_LENGTH(PERCENTILES); pctIdx++)
+    {
+        int sampleIdx = PERCENTILES[pctIdx] / 100 * (sampleCnt - 1) + 0.5;
+        printf("  p%-4g %8.1f", PERCENTILES[pctIdx], samples[sampleIdx] / 1000.0);
+    }
+    printf("  max %8.1f us\n", samples[sampleCnt - 1] / 1000.0);
+}
+
+
+/*
+ * Feeds synthetic note-on messages through parse_rx_data() into a fresh
+ * virtual keyboard and reads them back from its evdev node. F24 is used so
+ * the focused application is unlikely to react to the test.
+ */
+static int selftest_latency(int iterations)
+{
+    static KEYMAP_NODE_T testNode;
+    static struct input_event testEvents[MAX_ACTION_EVENTS];
+    static unsigned char testCode[VM_MAX_CODE];
+    unsigned char noteOn[] = { MIDI_CMD_NOTE_ON, SELFTEST_NOTE, 0x7f };
+    int sampleCnt = iterations - SELFTEST_WARMUP_ITERATIONS;
+    long long *evdevLatency = (long long*)calloc(sampleCnt, sizeof(long long));
+    long long *readerLatency = (long long*)calloc(sampleCnt, sizeof(long long));
+    int clockId = CLOCK_MONOTONIC;
+    unsigned long allocCount = 0;
+    int kbFd, evFd = -1;
+    int result = 1;
+
+    testNode.key = SELFTEST_NOTE;
+    testNode.channel = OMNI_CHANNEL;
+    testNode.action = "F24";
+    testNode.codeLen = compile_bytecode(testNode.action, testCode, testEvents, &testNode.eventCnt);
+    testNode.code = testCode;
+    testNode.events = testEvents;
+    gKeymapTable[0][SELFTEST_NOTE] = &testNode;
+
+    kbFd = initialize_kb();
+    if (kbFd == -1)
+    {
+        error("cannot create virtual keyboard: %s", strerror(errno));
+        goto _selftest_exit;
+    }
+    evFd = open_uinput_evdev(kbFd);
+    if (evFd == -1)
+    {
+        goto _selftest_exit;
+    }
+    ioctl(evFd, EVIOCSCLOCKID, &clockId);
+
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+        long long evdevNs;
+        if (iteration == SELFTEST_WARMUP_ITERATIONS)
+        {
+            allocCount = ALLOC_COUNT();
+        }
+        long long ingestNs = monotonic_ns();
+
+        parse_rx_data(kbFd, -1, noteOn, sizeof(noteOn));
+        if (wait_for_press(evFd, KEY_F24, &evdevNs) != 0)
+        {
+            error("timed out waiting for event %d", iteration);
+            goto _selftest_exit;
+        }
+        if (iteration >= SELFTEST_WARMUP_ITERATIONS)
+        {
+            readerLatency[iteration - SELFTEST_WARMUP_ITERATIONS] = monotonic_ns() - ingestNs;
+            evdevLatency[iteration - SELFTEST_WARMUP_ITERATIONS] = evdevNs - ingestNs;
+        }
+    }
+
+    // Always 0 unless built with DEBUG=1
+    allocCount = ALLOC_COUNT() - allocCount;
+
+    printf("MIDI ingest to evdev latency over %d samples:\n", sampleCnt);
+    print_percentiles("evdev", evdevLatency, sampleCnt);
+    print_percentiles("reader", readerLatency, sampleCnt);
+    if (allocCount != 0)
+    {
+        error("%lu heap allocations in the MIDI path", allocCount);
+        goto _selftest_exit;
+    }
+    result = 0;
+
+_selftest_exit:
+    if (evFd != -1)
+    {
+        close(evFd);
+    }
+    if (kbFd != -1)
+    {
+        close_kb(kbFd);
+    }
+    free(evdevLatency);
+    free(readerLatency);
+    return result;
+}
+
+
+#define BENCH_REPEATS 9
+#define BENCH_RETRIES 2
+#define BENCH_MIN_RUN_NS 50000000LL
+#define BENCH_JSON_MAX 4096
+
+// Fixed inputs so results are comparable between builds
+static char BENCH_KEYMAP[] =
+    "0x3C,CTRL+C\n"
+    "0x3D,TYPE:\"git status\\n\"\n"
+    "0x3E@10,DO:TOGGLE 0; IF; KEY F13; ELSE; KEY F14; END\n"
+    "CC:0x01,REL_WHEEL:ABS:1:1.5\n"
+    "CC:0x10,REL_X:REL:2:1.2\n"
+    "PB,ABS_X:128:32\n";
+static const char BENCH_TYPE_ACTION[] = "TYPE:\"The quick brown fox, 1234!\\n\"";
+
+static volatile int gBenchSink;
+
+/*
+ * Fixed integer work that every other result is divided by, so a baseline
+ * recorded on a faster or slower machine still compares fairly.
+ */
+static void bench_calibration(int iterations)
+{
+    unsigned int state = gBenchSink;
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+        state = state * 1664525u + 1013904223u;
+        state ^= state >> 13;
+    }
+    gBenchSink += state;
+}
+
+
+static void bench_keymap_lookup(int iterations)
+{
+    int hits = 0;
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+        hits += keymap_get_action(iteration & 0x0f, (iteration >> 4) & 0x7f) != NULL;
+    }
+    gBenchSink += hits;
+}
+
+
+static void bench_action_resolution(int iterations)
+{
+    const KEYMAP_NODE_T *combo = keymap_get_action(0, 0x3c);
+    const KEYMAP_NODE_T *program = keymap_get_action(9, 0x3e);
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+        perform_action(-1, (iteration & 1) ? program : combo);
+        kb_flush(-1);
+    }
+}
+
+
+static const unsigned char BENCH_MIDI[] = {
+    0x90, 0x3c, 0x40, 0xf8, 0x3c, 0x00, 0xb0, 0x01, 0x20, 0x01, 0x22, 0xf8,
+    0xb0, 0x10, 0x01, 0x10, 0x7f, 0xe0, 0x00, 0x40, 0x10, 0x41, 0xfe, 0x99,
+    0x3e, 0x7f, 0x3e, 0x00, 0x80, 0x3c, 0x00, 0xf8, 0xb0, 0x07, 0x40, 0xf8,
+};
+
+static void bench_realtime_filter(int iterations)
+{
+    unsigned char buf[sizeof(BENCH_MIDI)];
+    int length = 0;
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+        memcpy(buf, BENCH_MIDI, sizeof(buf));
+        length += filter_realtime_bytes(buf, sizeof(buf), 1, 1);
     }
+    gBenchSink += length;
 }
 
 
-static void list_card_devices(int card)
+static void bench_midi_parse(int iterations)
 {
-    snd_ctl_t *ctl;
-    char name[32];
-    int device;
-    int err;
-
-    sprintf(name, "hw:%d", card);
-    if ((err = snd_ctl_open(&ctl, name, 0)) < 0) {
-        error("cannot open control for card %d: %s", card, snd_strerror(err));
-        return;
+    unsigned char buf[sizeof(BENCH_MIDI)];
+    int length = filter_realtime_bytes(memcpy(buf, BENCH_MIDI, sizeof(buf)), sizeof(buf), 1, 1);
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+        parse_rx_data(-1, -1, buf, length);
     }
-    device = -1;
-    for (;;) {
-        if ((err = snd_ctl_rawmidi_next_device(ctl, &device)) < 0) {
-            error("cannot determine device number: %s", snd_strerror(err));
-            break;
-        }
-        if (device < 0)
-            break;
-        list_device(ctl, card, device);
+}
+
+
+static void bench_frame_build(int iterations)
+{
+    static struct input_event events[MAX_ACTION_EVENTS];
+    int eventCnt = 0;
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+        eventCnt += compile_action(BENCH_TYPE_ACTION, events);
+        cc_accumulate(gCcMap[0][0x10], (iteration & 1) ? 0x03 : 0x7e);
+        eventCnt += build_rel_frame(events);
     }
-    snd_ctl_close(ctl);
+    gBenchSink += eventCnt;
 }
 
 
-static void device_list(void)
+typedef struct BenchT
 {
-    int card, err;
+    const char *name;
+    void (*run)(int iterations);
+} BENCH_T;
+
+// The calibration loop must stay first, the rest are compared relative to it
+const BENCH_T BENCHMARKS[] = {
+//  {name,                  run                         },
+    {"calibration",         bench_calibration           },
+    {"keymap_lookup",       bench_keymap_lookup         },
+    {"action_resolution",   bench_action_resolution     },
+    {"realtime_filter",     bench_realtime_filter       },
+    {"midi_parse",          bench_midi_parse            },
+    {"frame_build",         bench_frame_build           },
+};
+#define BENCH_COUNT (ARRAY_LENGTH(BENCHMARKS))
 
-    card = -1;
-    if ((err = snd_card_next(&card)) < 0) {
-        error("cannot determine card number: %s", snd_strerror(err));
-        return;
-    }
-    if (card < 0) {
-        error("no sound card found");
-        return;
-    }
-    puts("Dir Device    Name");
-    do {
-        list_card_devices(card);
-        if ((err = snd_card_next(&card)) < 0) {
-            error("cannot determine card number: %s", snd_strerror(err));
-            break;
-        }
-    } while (card >= 0);
+
+static int compare_double(const void *a, const void *b)
+{
+    double lhs = *(const double*)a;
+    double rhs = *(const double*)b;
+    return (lhs > rhs) - (lhs < rhs);
 }
 
 
-static void rawmidi_list(void)
+/*
+ * Doubles the iteration count until one run takes BENCH_MIN_RUN_NS, which
+ * also warms caches.
+ */
+static int bench_size(const BENCH_T *bench)
 {
-    snd_output_t *output;
-    snd_config_t *config;
-    int err;
+    int iterations = 1;
 
-    if ((err = snd_config_update()) < 0) {
-        error("snd_config_update failed: %s", snd_strerror(err));
-        return;
-    }
-    if ((err = snd_output_stdio_attach(&output, stdout, 0)) < 0) {
-        error("snd_output_stdio_attach failed: %s", snd_strerror(err));
-        return;
-    }
-    if (snd_config_search(snd_config, "rawmidi", &config) >= 0) {
-        puts("RawMIDI list:");
-        snd_config_save(config, output);
+    for (;;)
+    {
+        long long start = monotonic_ns();
+        bench->run(iterations);
+        if (monotonic_ns() - start >= BENCH_MIN_RUN_NS || iterations >= INT_MAX / 2)
+        {
+            return iterations;
+        }
+        iterations *= 2;
     }
-    snd_output_close(output);
 }
 
 
-static int send_midi_interleaved(void)
+static double bench_run(const BENCH_T *bench, int iterations)
 {
-    int err;
-    char *data = send_data;
-    size_t buffer_size;
-    snd_rawmidi_params_t *param;
-    snd_rawmidi_status_t *st;
-
-    snd_rawmidi_status_alloca(&st);
+    long long start = monotonic_ns();
+    bench->run(iterations);
+    return (double)(monotonic_ns() - start) / iterations;
+}
 
-    snd_rawmidi_params_alloca(&param);
-    snd_rawmidi_params_current(output, param);
-    buffer_size = snd_rawmidi_params_get_buffer_size(param);
 
-    while (data < (send_data + send_data_length)) {
-        int len = send_data + send_data_length - data;
-        char *temp;
+/*
+ * Times BENCH_REPEATS runs, each directly followed by a run of the
+ * calibration loop, and returns the median ns/op. The median ratio to the
+ * neighbouring calibration runs goes to ratio, which cancels out frequency
+ * changes and other load on the machine while the benchmarks run.
+ */
+static double bench_measure(const BENCH_T *bench, int calIterations, double *ratio)
+{
+    double samples[BENCH_REPEATS];
+    double ratios[BENCH_REPEATS];
+    int iterations = bench_size(bench);
 
-        if (data > send_data) {
-            snd_rawmidi_status(output, st);
-            do {
-                /* 320 µs per byte as noted in Page 1 of MIDI spec */
-                usleep((buffer_size - snd_rawmidi_status_get_avail(st)) * 320);
-                snd_rawmidi_status(output, st);
-            } while(snd_rawmidi_status_get_avail(st) < buffer_size);
-            usleep(sysex_interval * 1000);
-        }
+    for (int repeat = 0; repeat < BENCH_REPEATS; repeat++)
+    {
+        samples[repeat] = bench_run(bench, iterations);
+        ratios[repeat] = samples[repeat] / bench_run(&BENCHMARKS[0], calIterations);
+    }
+    qsort(samples, BENCH_REPEATS, sizeof(double), compare_double);
+    qsort(ratios, BENCH_REPEATS, sizeof(double), compare_double);
+    *ratio = ratios[BENCH_REPEATS / 2];
+    return samples[BENCH_REPEATS / 2];
+}
 
-        /* find end of SysEx */
-        if ((temp = memchr(data, 0xf7, len)) != NULL)
-            len = temp - data + 1;
 
-        if ((err = snd_rawmidi_write(output, data, len)) < 0)
-            return err;
+/*
+ * Returns the value stored under "name" in a flat JSON object, or -1.
+ */
+static double bench_baseline_value(const char *json, const char *name)
+{
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\"", name);
 
-        data += len;
+    const char *entry = strstr(json, key);
+    if (entry == NULL || (entry = strchr(entry + strlen(key), ':')) == NULL)
+    {
+        return -1;
     }
-
-    return 0;
+    return strtod(entry + 1, NULL);
 }
 
 
 /*
- * prints MIDI commands, formatting them nicely
+ * Runs every benchmark on fixed inputs and reports nanoseconds per operation,
+ * see bench_measure(). Output goes to fd -1 so frames are built and batched
+ * but never written, keeping syscall cost out of the results. With a
+ * baseline, each result is scaled by the calibration loop of both runs and
+ * the run fails when any is more than threshold percent slower or missing
+ * from the baseline. With a save path, writes the results as a new baseline.
+ * DEBUG=1 builds also fail when any benchmark allocates from the heap.
  */
-static void print_byte(unsigned char byte)
+static int benchmark(const char *baselineFile, const char *saveFile, double threshold)
 {
-    static enum {
-        STATE_UNKNOWN,
-        STATE_1PARAM,
-        STATE_1PARAM_CONTINUE,
-        STATE_2PARAM_1,
-        STATE_2PARAM_2,
-        STATE_2PARAM_1_CONTINUE,
-        STATE_SYSEX
-    } state = STATE_UNKNOWN;
-    int newline = 0;
+    char json[BENCH_JSON_MAX] = "";
+    double results[BENCH_COUNT];
+    double ratios[BENCH_COUNT];
+    int regressions = 0;
+    int missing = 0;
+    int allocating = 0;
+
+    FILE *km_file = fmemopen(BENCH_KEYMAP, strlen(BENCH_KEYMAP), "r");
+    if (km_file == NULL || load_keymap_file(km_file) != 0)
+    {
+        error("cannot load benchmark keymap");
+        return 1;
+    }
+    fclose(km_file);
+    if (baselineFile != NULL)
+    {
+        FILE *baseline = fopen(baselineFile, "r");
+        if (baseline == NULL)
+        {
+            error("cannot open baseline %s: %s", baselineFile, strerror(errno));
+            return 1;
+        }
+        json[fread(json, 1, sizeof(json) - 1, baseline)] = '\x00';
+        fclose(baseline);
+    }
 
-    if (byte >= 0xf8)
-        newline = 1;
-    else if (byte >= 0xf0) {
-        newline = 1;
-        switch (byte) {
-        case 0xf0:
-            state = STATE_SYSEX;
-            break;
-        case 0xf1:
-        case 0xf3:
-            state = STATE_1PARAM;
-            break;
-        case 0xf2:
-            state = STATE_2PARAM_1;
-            break;
-        case 0xf4:
-        case 0xf5:
-        case 0xf6:
-            state = STATE_UNKNOWN;
-            break;
-        case 0xf7:
-            newline = state != STATE_SYSEX;
-            state = STATE_UNKNOWN;
-            break;
+    int calIterations = bench_size(&BENCHMARKS[0]);
+
+    printf("\n%-20s %12s %12s %9s\n", "benchmark", "ns/op", "baseline", "change");
+    for (int benchIdx = 0; benchIdx < BENCH_COUNT; benchIdx++)
+    {
+        const BENCH_T *bench = &BENCHMARKS[benchIdx];
+        unsigned long allocCount = ALLOC_COUNT();
+        results[benchIdx] = bench_measure(bench, calIterations, &ratios[benchIdx]);
+        double ratio = ratios[benchIdx];
+
+        // Always 0 unless built with DEBUG=1, see make check-alloc
+        allocCount = ALLOC_COUNT() - allocCount;
+        if (allocCount != 0)
+        {
+            error("%lu heap allocations in %s", allocCount, bench->name);
+            allocating++;
         }
-    } else if (byte >= 0x80) {
-        newline = 1;
-        if (byte >= 0xc0 && byte <= 0xdf)
-            state = STATE_1PARAM;
-        else
-            state = STATE_2PARAM_1;
-    } else /* b < 0x80 */ {
-        int running_status = 0;
-        newline = state == STATE_UNKNOWN;
-        switch (state) {
-        case STATE_1PARAM:
-            state = STATE_1PARAM_CONTINUE;
-            break;
-        case STATE_1PARAM_CONTINUE:
-            running_status = 1;
-            break;
-        case STATE_2PARAM_1:
-            state = STATE_2PARAM_2;
-            break;
-        case STATE_2PARAM_2:
-            state = STATE_2PARAM_1_CONTINUE;
-            break;
-        case STATE_2PARAM_1_CONTINUE:
-            running_status = 1;
-            state = STATE_2PARAM_2;
-            break;
-        default:
-            break;
+
+        double reference = bench_baseline_value(json, bench->name);
+        double calibration = bench_baseline_value(json, BENCHMARKS[0].name);
+        if (reference <= 0 || calibration <= 0)
+        {
+            printf("%-20s %12.2f %12s %9s\n", bench->name, results[benchIdx], "-", "-");
+            missing += baselineFile != NULL;
+            continue;
         }
-        if (running_status)
-            fputs("\n  ", stdout);
+        // Relative to the calibration loop, except for the loop itself
+        double change = benchIdx == 0 ? (results[0] - reference) / reference * 100 :
+                        (ratio / (reference / calibration) - 1) * 100;
+        // A regression has to show up in every attempt, not in one noisy burst
+        for (int retry = 0; benchIdx != 0 && change > threshold && retry < BENCH_RETRIES; retry++)
+        {
+            double retryResult = bench_measure(bench, calIterations, &ratio);
+            double retryChange = (ratio / (reference / calibration) - 1) * 100;
+            if (retryChange < change)
+            {
+                change = retryChange;
+                results[benchIdx] = retryResult;
+                ratios[benchIdx] = ratio;
+            }
+        }
+        int regressed = benchIdx != 0 && change > threshold;
+        regressions += regressed;
+        printf("%-20s %12.2f %12.2f %+8.1f%%%s\n", bench->name, results[benchIdx], reference, change,
+               regressed ? "  REGRESSION" : "");
     }
-    printf("%c%02X", newline ? '\n' : ' ', byte);
-}
 
-static void parse_rx_data(int kbFd, unsigned char *buf, int bufLen)
-{
-    int currentIdx = 0;
-    while (currentIdx < bufLen)
+    if (saveFile != NULL)
     {
-        unsigned char data = buf[currentIdx++];
-        unsigned char dataNext = buf[currentIdx];
-        const char *action = keymap_get_action(data);
-        if (data >= 0x80)  // Control characters
+        FILE *save = fopen(saveFile, "w");
+        if (save == NULL)
         {
-            //
+            error("cannot write %s: %s", saveFile, strerror(errno));
+            return 1;
         }
-        else if ((action != NULL) && (dataNext != 0))
+        fprintf(save, "{\n");
+        for (int benchIdx = 0; benchIdx < BENCH_COUNT; benchIdx++)
         {
-            printf("\nInput: %s\n", action);
-            perform_action(kbFd, action);
-            currentIdx++;
+            // Saved as the calibrated value so the ratio is what gets compared later
+            double saved = benchIdx == 0 ? results[0] : ratios[benchIdx] * results[0];
+            fprintf(save, "    \"%s\": %.2f%s\n", BENCHMARKS[benchIdx].name, saved,
+                    benchIdx + 1 < BENCH_COUNT ? "," : "");
         }
+        fprintf(save, "}\n");
+        fclose(save);
     }
+    if (allocating > 0)
+    {
+        error("%d benchmark(s) allocated in the MIDI path", allocating);
+        return 1;
+    }
+    if (missing > 0)
+    {
+        error("%d benchmark(s) missing from baseline %s", missing, baselineFile);
+        return 1;
+    }
+    if (regressions > 0)
+    {
+        error("%d benchmark(s) regressed by more than %g%%", regressions, threshold);
+        return 1;
+    }
+    return 0;
 }
 
 
+// Fixed poll slots, followed by the rawmidi descriptors
+enum
+{
+    PFD_TIMEOUT,
+    PFD_REPEAT,
+    PFD_EXEC,
+    PFD_MIDI,
+};
+
+
 static void sig_handler(int dummy)
 {
     stop = 1;
@@ -634,9 +3212,10 @@ static void sig_handler(int dummy)
 
 int main(int argc, char *argv[])
 {
-    static const char short_options[] = "hVk:lLp:t:aci:";
+    static const char short_options[] = "hvVk:lLp:t:aci:w:";
     static const struct option long_options[] = {
         {"help", 0, NULL, 'h'},
+        {"verbose", 0, NULL, 'v'},
         {"version", 0, NULL, 'V'},
         {"keymap", 1, NULL, 'k'},
         {"list-devices", 0, NULL, 'l'},
@@ -647,12 +3226,18 @@ int main(int argc, char *argv[])
         {"active-sensing", 0, NULL, 'a'},
         {"clock", 0, NULL, 'c'},
         {"sysex-interval", 1, NULL, 'i'},
+        {"exec-workers", 1, NULL, 'w'},
+        {"selftest-latency", 2, NULL, 'S'},
+        {"benchmark", 2, NULL, 'B'},
+        {"benchmark-save", 1, NULL, 'E'},
+        {"benchmark-threshold", 1, NULL, 'R'},
         { }
     };
     int c, err, ok = 0;
     int ignore_active_sensing = 1;
     int ignore_clock = 1;
     int kbFd = -1;
+    int padFd = -1;
     char *keymap_file = "";
     struct itimerspec itimerspec = { .it_interval = { 0, 0 } };
 
@@ -690,6 +3275,36 @@ int main(int argc, char *argv[])
         case 'i':
             sysex_interval = atoi(optarg);
             break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'B':
+            do_benchmark = 1;
+            benchmark_baseline = optarg;
+            break;
+        case 'E':
+            do_benchmark = 1;
+            benchmark_save = optarg;
+            break;
+        case 'R':
+            benchmark_threshold = atof(optarg);
+            break;
+        case 'w':
+            exec_workers = atoi(optarg);
+            if (exec_workers < 1 || exec_workers > EXEC_MAX_WORKERS)
+            {
+                error("exec workers must be between 1 and %d", EXEC_MAX_WORKERS);
+                return 1;
+            }
+            break;
+        case 'S':
+            selftest_iterations = optarg ? atoi(optarg) : SELFTEST_DEFAULT_ITERATIONS;
+            if (selftest_iterations <= SELFTEST_WARMUP_ITERATIONS)
+            {
+                error("selftest needs more than %d iterations", SELFTEST_WARMUP_ITERATIONS);
+                return 1;
+            }
+            break;
         default:
             error("Try `amidi --help' for more information.");
             return 1;
@@ -713,6 +3328,14 @@ int main(int argc, char *argv[])
     {
         return 0;
     }
+    if (selftest_iterations)
+    {
+        return selftest_latency(selftest_iterations);
+    }
+    if (do_benchmark)
+    {
+        return benchmark(benchmark_baseline, benchmark_save, benchmark_threshold);
+    }
 
     if (strcmp(port_name, "") == 0)
     {
@@ -731,9 +3354,15 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (gExecCommandCnt > 0 && exec_pool_start(exec_workers) != 0)
+    {
+        goto _exit2;
+    }
+
     inputp = &input;
 
-    outputp = NULL;
+    // Opened only when a program sends MIDI feedback
+    outputp = gMidiFeedbackUsed ? &output : NULL;
 
     if ((err = snd_rawmidi_open(inputp, outputp, port_name, SND_RAWMIDI_NONBLOCK)) < 0) {
         error("cannot open port \"%s\": %s", port_name, snd_strerror(err));
@@ -762,27 +3391,46 @@ int main(int argc, char *argv[])
     }
 
     kbFd = initialize_kb();
+    if (gGamepadUsed)
+    {
+        padFd = initialize_gamepad();
+        if (padFd == -1)
+        {
+            error("cannot create gamepad: %s", strerror(errno));
+            goto _exit;
+        }
+    }
 
     if (inputp) {
         int read = 0;
         int npfds;
         struct pollfd *pfds;
 
-        npfds = 1 + snd_rawmidi_poll_descriptors_count(input);
+        npfds = PFD_MIDI + snd_rawmidi_poll_descriptors_count(input);
         pfds = alloca(npfds * sizeof(struct pollfd));
 
         if (timeout > 0) {
-            pfds[0].fd = timerfd_create(CLOCK_MONOTONIC, 0);
-            if (pfds[0].fd == -1) {
+            pfds[PFD_TIMEOUT].fd = timerfd_create(CLOCK_MONOTONIC, 0);
+            if (pfds[PFD_TIMEOUT].fd == -1) {
                 error("cannot create timer: %s", strerror(errno));
                 goto _exit;
             }
-            pfds[0].events = POLLIN;
+            pfds[PFD_TIMEOUT].events = POLLIN;
         } else {
-            pfds[0].fd = -1;
+            pfds[PFD_TIMEOUT].fd = -1;
+        }
+
+        gRepeatTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (gRepeatTimerFd == -1) {
+            error("cannot create repeat timer: %s", strerror(errno));
+            goto _exit;
         }
+        pfds[PFD_REPEAT].fd = gRepeatTimerFd;
+        pfds[PFD_REPEAT].events = POLLIN;
+        pfds[PFD_EXEC].fd = gExecPool.resultFd[0];
+        pfds[PFD_EXEC].events = POLLIN;
 
-        snd_rawmidi_poll_descriptors(input, &pfds[1], npfds - 1);
+        snd_rawmidi_poll_descriptors(input, &pfds[PFD_MIDI], npfds - PFD_MIDI);
 
         signal(SIGINT, sig_handler);
 
@@ -791,12 +3439,13 @@ int main(int argc, char *argv[])
 
             itimerspec.it_value.tv_nsec = modff(timeout, &timeout_int) * NSEC_PER_SEC;
             itimerspec.it_value.tv_sec = timeout_int;
-            err = timerfd_settime(pfds[0].fd, 0, &itimerspec, NULL);
+            err = timerfd_settime(pfds[PFD_TIMEOUT].fd, 0, &itimerspec, NULL);
             if (err < 0) {
                 error("cannot set timer: %s", strerror(errno));
                 goto _exit;
             }
         }
+        unsigned long allocCount = ALLOC_COUNT();
         for (;;) {
             unsigned char buf[256];
             int i, length;
@@ -810,7 +3459,16 @@ int main(int argc, char *argv[])
                 break;
             }
 
-            err = snd_rawmidi_poll_descriptors_revents(input, &pfds[1], npfds - 1, &revents);
+            if (pfds[PFD_REPEAT].revents & POLLIN)
+                repeat_service(kbFd);
+            if (pfds[PFD_EXEC].revents & POLLIN)
+                exec_collect();
+            if (pfds[PFD_EXEC].revents & (POLLHUP | POLLERR)) {
+                error("exec workers exited, EXEC actions will be dropped");
+                pfds[PFD_EXEC].fd = -1;
+            }
+
+            err = snd_rawmidi_poll_descriptors_revents(input, &pfds[PFD_MIDI], npfds - PFD_MIDI, &revents);
             if (err < 0) {
                 error("cannot get poll events: %s", snd_strerror(errno));
                 break;
@@ -818,7 +3476,7 @@ int main(int argc, char *argv[])
             if (revents & (POLLERR | POLLHUP))
                 break;
             if (!(revents & POLLIN)) {
-                if (pfds[0].revents & POLLIN)
+                if (pfds[PFD_TIMEOUT].revents & POLLIN)
                     break;
                 continue;
             }
@@ -830,13 +3488,7 @@ int main(int argc, char *argv[])
                 error("cannot read from port \"%s\": %s", port_name, snd_strerror(err));
                 break;
             }
-            length = 0;
-            for (i = 0; i < err; ++i)
-                if ((buf[i] != MIDI_CMD_COMMON_CLOCK &&
-                     buf[i] != MIDI_CMD_COMMON_SENSING) ||
-                    (buf[i] == MIDI_CMD_COMMON_CLOCK   && !ignore_clock) ||
-                    (buf[i] == MIDI_CMD_COMMON_SENSING && !ignore_active_sensing))
-                    buf[length++] = buf[i];
+            length = filter_realtime_bytes(buf, err, ignore_clock, ignore_active_sensing);
             if (length == 0)
                 continue;
             read += length;
@@ -851,10 +3503,15 @@ int main(int argc, char *argv[])
                 }
                 fflush(stdout);
             }
-            parse_rx_data(kbFd, buf, length);
+            parse_rx_data(kbFd, padFd, buf, length);
+
+            if (DEBUG && ALLOC_COUNT() != allocCount) {
+                error("heap allocation in the MIDI loop");
+                allocCount = ALLOC_COUNT();
+            }
 
             if (timeout > 0) {
-                err = timerfd_settime(pfds[0].fd, 0, &itimerspec, NULL);
+                err = timerfd_settime(pfds[PFD_TIMEOUT].fd, 0, &itimerspec, NULL);
                 if (err < 0) {
                     error("cannot set timer: %s", strerror(errno));
                     break;
@@ -876,6 +3533,15 @@ _exit2:
     {
         close_kb(kbFd);
     }
+    if (padFd != -1)
+    {
+        close_kb(padFd);
+    }
+    if (gRepeatTimerFd != -1)
+    {
+        close(gRepeatTimerFd);
+    }
+    exec_pool_stop();
 
     return !ok;
 }